@@ -3,6 +3,8 @@
 // found in the LICENSE file.
 
 #include "sommelier.h"            // NOLINT(build/include_directory)
+#include "sommelier-copy.h"       // NOLINT(build/include_directory)
+#include "sommelier-stats.h"      // NOLINT(build/include_directory)
 #include "sommelier-timing.h"     // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"    // NOLINT(build/include_directory)
 #include "sommelier-transform.h"  // NOLINT(build/include_directory)
@@ -13,6 +15,7 @@
 #include <libdrm/drm_fourcc.h>
 #include <limits.h>
 #include <pixman.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -20,6 +23,8 @@
 #include <wayland-client.h>
 #include <wayland-util.h>
 
+#include <vector>
+
 #include "drm-server-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-explicit-synchronization-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
@@ -43,6 +48,18 @@ struct dma_buf_sync_file {
 #define DMA_BUF_IOCTL_EXPORT_SYNC_FILE \
   _IOWR(DMA_BUF_BASE, 2, struct dma_buf_sync_file)
 
+// Copies smaller than this are done inline even with --async-commit, unless
+// earlier commits are still pending, as the round trip through the copy
+// thread would cost more than the copy.
+#define ASYNC_COMMIT_MIN_BYTES (256 * 1024)
+
+// Upper bound of --buffer-queue-depth=adaptive. Beyond quadruple buffering
+// the host is stalled, and more buffers only waste memory.
+#define ADAPTIVE_QUEUE_MAX_DEPTH 4
+
+// Queue depth of surfaces whose client is over --client-memory-limit.
+#define OVER_LIMIT_QUEUE_DEPTH 2
+
 struct sl_host_compositor {
   struct sl_compositor* compositor;
   struct wl_resource* resource;
@@ -56,10 +73,51 @@ struct sl_output_buffer {
   uint32_t format;
   struct wl_buffer* internal;
   struct sl_mmap* mmap;
+  const struct sl_copy_kernel* copy_kernel;
   struct pixman_region32 surface_damage;
   struct pixman_region32 buffer_damage;
   pixman_image_t* shape_image;
+  // Shape shape_image was last generated for, valid if shape_valid is set.
+  pixman_region32_t shape;
+  bool shape_valid;
+  // Size of the contents the buffer was last filled with. Within a
+  // --buffer-size-bucket a buffer is reused for contents of another size.
+  uint32_t contents_width;
+  uint32_t contents_height;
   struct sl_host_surface* surface;
+  // When the buffer was last committed, 0 once the host has released it.
+  uint64_t commit_time_ns;
+  // Hashes of the buffer contents (see --tile-hash-damage).
+  struct sl_copy_tile_hashes tile_hashes;
+  // Explicit release requested for the last commit of the buffer, until the
+  // host has sent it. Once set up, releases only come through these objects
+  // and wl_buffer.release is ignored.
+  struct zwp_linux_buffer_release_v1* release;
+  bool explicit_release;
+  // True for dma-bufs, which are the only buffers explicit releases can be
+  // requested for.
+  bool is_dmabuf;
+  // Fence the host signals once its GPU is done with the buffer, or -1.
+  // The buffer stays busy until then.
+  int release_fence_fd;
+  std::unique_ptr<struct wl_event_source> release_fence_source;
+  // When the host released the buffer with a fence that was still pending.
+  uint64_t release_fence_start_ns;
+};
+
+// A commit whose host side is deferred until its damage copy has completed
+// on the copy queue (see --async-commit).
+struct sl_pending_commit {
+  struct wl_list link;
+  struct sl_host_surface* host;
+  // Ticket of the damage copy, or 0 if there is nothing to copy and the
+  // commit is only waiting for earlier commits to keep them in order.
+  uint64_t ticket;
+  // The client's buffer, released once the copy has completed.
+  struct sl_mmap* contents;
+  struct sl_output_buffer* buffer;
+  // Set while the commit is held back for the acquire fence of its surface.
+  bool fenced;
 };
 
 static void sl_virtwl_dmabuf_sync(int fd, __u32 flags, struct sl_context* ctx) {
@@ -77,11 +135,39 @@ static void sl_virtwl_dmabuf_end_write(int fd, struct sl_context* ctx) {
   sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE, ctx);
 }
 
+static size_t sl_output_buffer_size(struct sl_output_buffer* buffer) {
+  size_t size = buffer->mmap->size;
+
+  if (buffer->shape_image)
+    size += buffer->width * buffer->height * 4;
+  return size;
+}
+
+// Moves the memory accounted to the surface of `buffer` over to `host`, which
+// is NULL for buffers in the context's pool.
+static void sl_output_buffer_set_surface(struct sl_output_buffer* buffer,
+                                         struct sl_host_surface* host) {
+  size_t size = sl_output_buffer_size(buffer);
+
+  if (buffer->surface)
+    buffer->surface->memory_bytes -= size;
+  buffer->surface = host;
+  if (host)
+    host->memory_bytes += size;
+}
+
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
+  sl_output_buffer_set_surface(buffer, NULL);
+  if (buffer->release)
+    zwp_linux_buffer_release_v1_destroy(buffer->release);
+  buffer->release_fence_source.reset();
+  if (buffer->release_fence_fd >= 0)
+    close(buffer->release_fence_fd);
   wl_buffer_destroy(buffer->internal);
   sl_mmap_unref(buffer->mmap);
   pixman_region32_fini(&buffer->surface_damage);
   pixman_region32_fini(&buffer->buffer_damage);
+  pixman_region32_fini(&buffer->shape);
   wl_list_remove(&buffer->link);
 
   if (buffer->shape_image)
@@ -94,20 +180,561 @@ static uint32_t try_wl_resource_get_id(wl_resource* resource) {
   return resource ? wl_resource_get_id(resource) : -1;
 }
 
-static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
-  struct sl_output_buffer* output_buffer =
-      static_cast<sl_output_buffer*>(wl_buffer_get_user_data(buffer));
+// Returns true if `buffer` can hold a width x height image of `format`.
+// Shaped contents are always composited into an ARGB8888 buffer with a
+// shape image.
+static bool sl_output_buffer_matches(struct sl_output_buffer* buffer,
+                                     uint32_t width,
+                                     uint32_t height,
+                                     uint32_t format,
+                                     bool shaped) {
+  if (buffer->width != width || buffer->height != height)
+    return false;
+  if (shaped)
+    return buffer->shape_image && buffer->format == WL_SHM_FORMAT_ARGB8888;
+  return buffer->format == format;
+}
+
+// Rounds the size of an output buffer for contents of the given size up to
+// the next multiple of --buffer-size-bucket. While a window is resized, most
+// sizes then map to a buffer that already exists, and the host is shown only
+// the valid top-left part through the viewport source rectangle. Limited to
+// single-plane dma-bufs, and to unshaped contents as the shape image must
+// match the contents' size.
+static void sl_output_buffer_alloc_size(struct sl_host_surface* host,
+                                        uint32_t format,
+                                        bool shaped,
+                                        uint32_t* width,
+                                        uint32_t* height) {
+  uint32_t bucket = host->ctx->buffer_size_bucket;
+
+  if (!bucket || shaped || !host->viewport ||
+      !host->ctx->channel->supports_dmabuf() ||
+      sl_shm_num_planes_for_shm_format(format) != 1)
+    return;
+
+  *width = (*width + bucket - 1) / bucket * bucket;
+  *height = (*height + bucket - 1) / bucket * bucket;
+}
+
+// Allocates the memory of a new output buffer through the channel. This may
+// block on a round trip to the host, whose time is recorded.
+static int sl_output_buffer_allocate(
+    struct sl_context* ctx,
+    const struct WaylandBufferCreateInfo& create_info,
+    struct WaylandBufferCreateOutput& create_output) {
+  uint64_t start = sl_monotonic_time_ns();
+  int rv;
+
+  rv = ctx->channel->allocate(create_info, create_output);
+  sl_stats_add(SL_STAT_OUTPUT_BUFFER_ALLOCATE_NS,
+               sl_monotonic_time_ns() - start);
+  return rv;
+}
+
+static void sl_output_buffer_pool_update_stats(struct sl_context* ctx) {
+  sl_stats_set(SL_STAT_OUTPUT_BUFFER_POOL_BYTES,
+               ctx->output_buffer_pool_bytes);
+}
+
+// Makes the next copy into `buffer` cover all of its contents.
+static void sl_output_buffer_damage_all(struct sl_output_buffer* buffer) {
+  pixman_region32_fini(&buffer->surface_damage);
+  pixman_region32_fini(&buffer->buffer_damage);
+  pixman_region32_init_rect(&buffer->surface_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+  pixman_region32_init_rect(&buffer->buffer_damage, 0, 0, MAX_SIZE, MAX_SIZE);
+}
+
+// Moves a released output buffer from its surface to the context's pool,
+// where any surface can pick it up, evicting the least recently used buffers
+// while the pool is over budget.
+static void sl_output_buffer_pool_put(struct sl_context* ctx,
+                                      struct sl_output_buffer* buffer) {
+  size_t size = sl_output_buffer_size(buffer);
+
+  if (size > ctx->buffer_pool_size) {
+    sl_output_buffer_destroy(buffer);
+    return;
+  }
+
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  sl_output_buffer_set_surface(buffer, NULL);
+  ctx->output_buffer_pool_bytes += size;
+
+  while (ctx->output_buffer_pool_bytes > ctx->buffer_pool_size) {
+    struct sl_output_buffer* oldest =
+        wl_container_of(ctx->output_buffer_pool.prev, oldest, link);
+
+    ctx->output_buffer_pool_bytes -= sl_output_buffer_size(oldest);
+    sl_output_buffer_destroy(oldest);
+    sl_stats_add(SL_STAT_OUTPUT_BUFFER_POOL_EVICTIONS, 1);
+  }
+  sl_output_buffer_pool_update_stats(ctx);
+}
+
+// Takes a matching buffer out of the context's pool and adds it to the
+// released buffers of `host`. Returns NULL if there is none.
+static struct sl_output_buffer* sl_output_buffer_pool_take(
+    struct sl_host_surface* host,
+    uint32_t width,
+    uint32_t height,
+    uint32_t format,
+    bool shaped) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer* buffer;
+
+  if (!ctx->buffer_pool_size)
+    return NULL;
+
+  wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+    if (sl_output_buffer_matches(buffer, width, height, format, shaped)) {
+      wl_list_remove(&buffer->link);
+      wl_list_insert(&host->released_buffers, &buffer->link);
+      sl_output_buffer_set_surface(buffer, host);
+      ctx->output_buffer_pool_bytes -= sl_output_buffer_size(buffer);
+      sl_output_buffer_pool_update_stats(ctx);
+      sl_stats_add(SL_STAT_OUTPUT_BUFFER_POOL_HITS, 1);
+
+      // The contents are another surface's, or an old frame of ours.
+      sl_output_buffer_damage_all(buffer);
+      return buffer;
+    }
+  }
+
+  sl_stats_add(SL_STAT_OUTPUT_BUFFER_POOL_MISSES, 1);
+  return NULL;
+}
+
+// Returns the number of bytes of output buffers held for the surfaces of
+// `client`.
+static size_t sl_client_memory_bytes(struct sl_context* ctx,
+                                     struct wl_client* client) {
+  struct sl_host_surface* host;
+  size_t bytes = 0;
+
+  wl_list_for_each(host, &ctx->host_surfaces, link) {
+    if (wl_resource_get_client(host->resource) == client)
+      bytes += host->memory_bytes;
+  }
+  return bytes;
+}
+
+// Returns true if the client of `host` holds more output buffer memory than
+// --client-memory-limit allows.
+static bool sl_host_surface_over_memory_limit(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+
+  return ctx->client_memory_limit &&
+         sl_client_memory_bytes(ctx, wl_resource_get_client(host->resource)) >
+             ctx->client_memory_limit;
+}
+
+// Hands released buffers beyond the surface's queue depth over to the pool,
+// oldest first, or frees them under memory pressure. The buffer that is about
+// to be committed is always kept.
+static void sl_host_surface_trim_buffers(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer *buffer, *prev;
+  int depth = host->buffer_queue_depth;
+  bool over_limit = sl_host_surface_over_memory_limit(host);
+  int excess;
+
+  // Memory pressure lowers the depth for a while (see --memory-pressure-*),
+  // and clients over their memory limit are held to double buffering.
+  if (ctx->memory_pressure) {
+    depth = depth ? MIN(depth, ctx->memory_pressure_queue_depth)
+                  : ctx->memory_pressure_queue_depth;
+  }
+  if (over_limit)
+    depth = depth ? MIN(depth, OVER_LIMIT_QUEUE_DEPTH) : OVER_LIMIT_QUEUE_DEPTH;
+  if (!depth)
+    return;
+
+  excess = wl_list_length(&host->busy_buffers) +
+           wl_list_length(&host->released_buffers) - depth;
+  wl_list_for_each_reverse_safe(buffer, prev, &host->released_buffers, link) {
+    if (excess <= 0)
+      break;
+    if (buffer == host->current_buffer)
+      continue;
+    if (ctx->memory_pressure || over_limit)
+      sl_output_buffer_destroy(buffer);
+    else
+      sl_output_buffer_pool_put(ctx, buffer);
+    --excess;
+  }
+}
+
+// Frees the released output buffers of `host`. The buffer the next commit
+// may use is always kept, and with `keep_one` otherwise the most recently
+// released one too, so that the next commit does not have to allocate.
+// Returns the number of bytes freed.
+static size_t sl_host_surface_free_released_buffers(
+    struct sl_host_surface* host,
+    bool keep_one) {
+  struct sl_output_buffer *buffer, *next, *kept = NULL;
+  size_t freed = 0;
+
+  wl_list_for_each(buffer, &host->released_buffers, link) {
+    if ((keep_one && !kept) || buffer == host->current_buffer)
+      kept = buffer;
+  }
+  wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+    if (buffer == kept)
+      continue;
+    freed += sl_output_buffer_size(buffer);
+    sl_output_buffer_destroy(buffer);
+  }
+  return freed;
+}
+
+// Frees the released output buffers of every surface of the client of `host`
+// if the client is over --client-memory-limit. Buffers the host holds cannot
+// be freed; they are trimmed as they are released instead.
+static void sl_host_surface_enforce_memory_limit(struct sl_host_surface* host) {
+  struct wl_client* client;
+  struct sl_host_surface* surface;
+  size_t freed = 0;
+
+  if (!sl_host_surface_over_memory_limit(host))
+    return;
+
+  client = wl_resource_get_client(host->resource);
+  wl_list_for_each(surface, &host->ctx->host_surfaces, link) {
+    if (wl_resource_get_client(surface->resource) == client)
+      freed += sl_host_surface_free_released_buffers(surface, false);
+  }
+  TRACE_EVENT("surface", "sl_host_surface_enforce_memory_limit",
+              "resource_id", try_wl_resource_get_id(host->resource), "bytes",
+              freed);
+  sl_stats_add(SL_STAT_MEMORY_LIMIT_BYTES, freed);
+}
+
+// Frees the released output buffers of surfaces that have not committed for
+// --idle-trim-timeout, such as minimized windows or static dialogs.
+static int sl_compositor_trim_idle_surfaces(void* data) {
+  struct sl_context* ctx = static_cast<sl_context*>(data);
+  uint64_t timeout_ns = ctx->idle_trim_timeout_ms * 1000000ull;
+  uint64_t now = sl_monotonic_time_ns();
+  struct sl_host_surface* host;
+
+  wl_list_for_each(host, &ctx->host_surfaces, link) {
+    size_t freed;
+
+    if (!host->last_commit_ns || now - host->last_commit_ns < timeout_ns)
+      continue;
+
+    freed = sl_host_surface_free_released_buffers(host, /*keep_one=*/true);
+    if (freed) {
+      TRACE_EVENT("surface", "sl_compositor_trim_idle_surfaces",
+                  "resource_id", try_wl_resource_get_id(host->resource),
+                  "bytes", freed);
+      sl_stats_add(SL_STAT_IDLE_TRIM_BYTES, freed);
+    }
+  }
+
+  wl_event_source_timer_update(ctx->idle_trim_timer.get(),
+                               ctx->idle_trim_timeout_ms);
+  return 0;
+}
+
+size_t sl_compositor_release_buffers(struct sl_context* ctx) {
+  struct sl_host_surface* host;
+  size_t freed = ctx->output_buffer_pool_bytes;
+
+  wl_list_for_each(host, &ctx->host_surfaces, link)
+    freed += sl_host_surface_free_released_buffers(host, /*keep_one=*/false);
+
+  while (!wl_list_empty(&ctx->output_buffer_pool)) {
+    struct sl_output_buffer* buffer =
+        wl_container_of(ctx->output_buffer_pool.next, buffer, link);
+
+    sl_output_buffer_destroy(buffer);
+  }
+  ctx->output_buffer_pool_bytes = 0;
+  sl_output_buffer_pool_update_stats(ctx);
+
+  return freed;
+}
+
+void sl_compositor_dump_memory(struct sl_context* ctx, FILE* stream) {
+  struct sl_host_surface *host, *other;
+
+  wl_list_for_each(host, &ctx->host_surfaces, link) {
+    struct wl_client* client = wl_resource_get_client(host->resource);
+    bool listed = false;
+    pid_t pid;
+
+    // Each client is listed once, at its first surface.
+    wl_list_for_each(other, &ctx->host_surfaces, link) {
+      if (other == host)
+        break;
+      if (wl_resource_get_client(other->resource) == client) {
+        listed = true;
+        break;
+      }
+    }
+    if (listed)
+      continue;
+
+    wl_client_get_credentials(client, &pid, NULL, NULL);
+    fprintf(stream, "client %d: %zu bytes\n", pid,
+            sl_client_memory_bytes(ctx, client));
+    wl_list_for_each(other, &ctx->host_surfaces, link) {
+      if (wl_resource_get_client(other->resource) != client ||
+          !other->memory_bytes)
+        continue;
+      fprintf(stream, "  surface %u: %zu bytes in %d buffers\n",
+              try_wl_resource_get_id(other->resource), other->memory_bytes,
+              wl_list_length(&other->busy_buffers) +
+                  wl_list_length(&other->released_buffers));
+    }
+  }
+  fprintf(stream, "buffer pool: %zu bytes\n", ctx->output_buffer_pool_bytes);
+}
+
+static uint64_t sl_moving_average(uint64_t average, uint64_t sample) {
+  // Weighs the new sample by 1/8, and starts from the first sample.
+  return average ? average - average / 8 + sample / 8 : sample;
+}
+
+// Picks the adaptive queue depth: one buffer, plus one for every commit
+// made while the host typically still holds a buffer. This grows the queue
+// while the host is slow to release buffers, and shrinks it back once the
+// surface commits less often than the host holds buffers.
+static void sl_host_surface_update_queue_depth(struct sl_host_surface* host) {
+  int depth;
+
+  if (!host->ctx->buffer_queue_adaptive || !host->commit_interval_ns)
+    return;
+
+  depth = 1 + host->release_latency_ns / host->commit_interval_ns;
+  depth = MIN(depth, ADAPTIVE_QUEUE_MAX_DEPTH);
+  if (depth != host->buffer_queue_depth) {
+    TRACE_EVENT("surface", "sl_host_surface_update_queue_depth",
+                "resource_id", try_wl_resource_get_id(host->resource),
+                "depth", depth);
+    host->buffer_queue_depth = depth;
+  }
+}
+
+// Makes an output buffer the host is done with available for reuse.
+static void sl_output_buffer_released(struct sl_output_buffer* output_buffer) {
   TRACE_EVENT("surface", "sl_output_buffer_release", "resource_id",
               try_wl_resource_get_id(output_buffer->surface->resource));
   struct sl_host_surface* host_surface = output_buffer->surface;
 
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+
+  if (output_buffer->commit_time_ns) {
+    uint64_t latency = sl_monotonic_time_ns() - output_buffer->commit_time_ns;
+
+    host_surface->release_latency_ns =
+        sl_moving_average(host_surface->release_latency_ns, latency);
+    output_buffer->commit_time_ns = 0;
+    sl_host_surface_update_queue_depth(host_surface);
+  }
+  sl_host_surface_trim_buffers(host_surface);
+}
+
+static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
+  struct sl_output_buffer* output_buffer =
+      static_cast<sl_output_buffer*>(wl_buffer_get_user_data(buffer));
+
+  // May refer to an earlier commit than the explicit releases do.
+  if (output_buffer->explicit_release)
+    return;
+
+  sl_output_buffer_released(output_buffer);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+// Called once the host's GPU is done with an output buffer it released.
+static int sl_handle_release_fence(int fd, uint32_t mask, void* data) {
+  struct sl_output_buffer* output_buffer =
+      static_cast<sl_output_buffer*>(data);
+  struct sl_host_surface* host = output_buffer->surface;
+
+  host->release_fence_wait_ns =
+      sl_monotonic_time_ns() - output_buffer->release_fence_start_ns;
+  TRACE_EVENT("surface", "sl_handle_release_fence", "resource_id",
+              try_wl_resource_get_id(host->resource), "wait_ns",
+              host->release_fence_wait_ns);
+  output_buffer->release_fence_source.reset();
+  close(output_buffer->release_fence_fd);
+  output_buffer->release_fence_fd = -1;
+  sl_output_buffer_released(output_buffer);
+  return 1;
+}
+
+// The buffer is only written to again once the fence has signaled. Until
+// then it stays busy, and the event loop waits for the fence instead of the
+// next commit blocking on it.
+static void sl_output_buffer_fenced_release(
+    void* data,
+    struct zwp_linux_buffer_release_v1* release,
+    int32_t fence) {
+  struct sl_output_buffer* output_buffer =
+      static_cast<sl_output_buffer*>(data);
+  struct pollfd pfd = {fence, POLLIN, 0};
+
+  zwp_linux_buffer_release_v1_destroy(release);
+  output_buffer->release = NULL;
+  output_buffer->explicit_release = false;
+  if (poll(&pfd, 1, 0) == 1) {
+    close(fence);
+    sl_output_buffer_released(output_buffer);
+    return;
+  }
+
+  output_buffer->release_fence_fd = fence;
+  output_buffer->release_fence_start_ns = sl_monotonic_time_ns();
+  output_buffer->release_fence_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(output_buffer->surface->ctx->host_display),
+      fence, WL_EVENT_READABLE, sl_handle_release_fence, output_buffer));
+  sl_stats_add(SL_STAT_GPU_WAITS_ASYNC, 1);
+}
+
+static void sl_output_buffer_immediate_release(
+    void* data,
+    struct zwp_linux_buffer_release_v1* release) {
+  struct sl_output_buffer* output_buffer =
+      static_cast<sl_output_buffer*>(data);
+
+  zwp_linux_buffer_release_v1_destroy(release);
+  output_buffer->release = NULL;
+  output_buffer->explicit_release = false;
+  sl_output_buffer_released(output_buffer);
+}
+
+static const struct zwp_linux_buffer_release_v1_listener
+    sl_output_buffer_release_listener = {sl_output_buffer_fenced_release,
+                                         sl_output_buffer_immediate_release};
+
+static void sl_host_surface_commit_dispatch(struct sl_host_surface* host,
+                                            uint64_t ticket,
+                                            struct sl_output_buffer* buffer);
+static void sl_compositor_complete_commits(struct sl_context* ctx);
+
+// Exports a sync_file that signals once all GPU writes to the buffer of
+// `sync_point` have completed. Returns the sync_file, or -1 if there is none.
+// Whether the kernel supports exporting fences is found out on first use.
+static int sl_sync_point_export_fence(struct sl_context* ctx,
+                                      struct sl_sync_point* sync_point) {
+  dma_buf_sync_file sync_file;
+  int ret;
+
+  if (ctx->fence_export_unsupported)
+    return -1;
+
+  sync_file.flags = DMA_BUF_SYNC_READ;
+  do {
+    ret = ioctl(sync_point->fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &sync_file);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret == -1) {
+    if (errno == ENOTTY) {
+      // Export sync file ioctl not implemented. Revert to guest side sync
+      // going forward.
+      ctx->fence_export_unsupported = true;
+      fprintf(stderr,
+              "DMA_BUF_IOCTL_EXPORT_SYNC_FILE not implemented, defaulting "
+              "to implicit fence for synchronization.\n");
+    } else {
+      fprintf(stderr, "Exporting fence failed with reason: %s.\n",
+              strerror(errno));
+    }
+    return -1;
+  }
+
+  return sync_file.fd;
+}
+
+// Forgets the acquire fence of `host`, if any.
+static void sl_host_surface_clear_acquire_fence(struct sl_host_surface* host) {
+  if (host->acquire_fence_fd < 0)
+    return;
+
+  host->acquire_fence_source.reset();
+  close(host->acquire_fence_fd);
+  host->acquire_fence_fd = -1;
+}
+
+// Called once the GPU has finished rendering the attached buffer. Forwards
+// the commit that was held back for it, if any, along with the commits
+// queued behind it.
+static void sl_host_surface_acquire_fence_signaled(
+    struct sl_host_surface* host) {
+  struct sl_pending_commit* pending;
+
+  host->acquire_fence_wait_ns =
+      sl_monotonic_time_ns() - host->acquire_fence_start_ns;
+  TRACE_EVENT("surface", "sl_host_surface_acquire_fence_signaled",
+              "resource_id", try_wl_resource_get_id(host->resource),
+              "wait_ns", host->acquire_fence_wait_ns);
+  sl_host_surface_clear_acquire_fence(host);
+  if (host->acquire_fence_commit) {
+    host->acquire_fence_commit = false;
+    wl_list_for_each(pending, &host->ctx->pending_commits, link) {
+      if (pending->host == host)
+        pending->fenced = false;
+    }
+    sl_compositor_complete_commits(host->ctx);
+  }
+}
+
+static int sl_handle_acquire_fence(int fd, uint32_t mask, void* data) {
+  sl_host_surface_acquire_fence_signaled(
+      static_cast<struct sl_host_surface*>(data));
+  return 1;
+}
+
+// Blocks until the acquire fence of `host`, if any, has signaled.
+static void sl_host_surface_wait_acquire_fence(struct sl_host_surface* host) {
+  struct pollfd pfd = {host->acquire_fence_fd, POLLIN, 0};
+  uint64_t start;
+  int ret;
+
+  if (host->acquire_fence_fd < 0)
+    return;
+
+  TRACE_EVENT("surface", "sl_host_surface_wait_acquire_fence", "resource_id",
+              try_wl_resource_get_id(host->resource));
+  start = sl_monotonic_time_ns();
+  do {
+    ret = poll(&pfd, 1, -1);
+  } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+  sl_stats_add(SL_STAT_GPU_WAIT_BLOCKED_NS, sl_monotonic_time_ns() - start);
+
+  // Also records the time waited since the fence was set.
+  sl_host_surface_acquire_fence_signaled(host);
+}
+
+// Arranges for the next commit of `host` to be held back until the sync
+// file `fd` signals, without blocking the event loop. Takes ownership of `fd`.
+static void sl_host_surface_set_acquire_fence(struct sl_host_surface* host,
+                                              int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+
+  // Nothing to wait for if rendering has already completed.
+  host->acquire_fence_wait_ns = 0;
+  if (poll(&pfd, 1, 0) == 1) {
+    close(fd);
+    return;
+  }
+
+  host->acquire_fence_fd = fd;
+  host->acquire_fence_start_ns = sl_monotonic_time_ns();
+  host->acquire_fence_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(host->ctx->host_display), fd,
+      WL_EVENT_READABLE, sl_handle_acquire_fence, host));
+  sl_stats_add(SL_STAT_GPU_WAITS_ASYNC, 1);
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   TRACE_EVENT("surface", "sl_host_surface_destroy", "resource_id",
@@ -130,6 +757,8 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (host->ctx->timing != NULL) {
     host->ctx->timing->UpdateLastAttach(resource_id, buffer_id);
   }
+  sl_host_surface_flush(host);
+  sl_host_surface_clear_acquire_fence(host);
   struct sl_host_buffer* host_buffer =
       buffer_resource ? static_cast<sl_host_buffer*>(
                             wl_resource_get_user_data(buffer_resource))
@@ -145,6 +774,7 @@ static void sl_host_surface_attach(struct wl_client* client,
     window_shaped = window->shaped;
 
   host->current_buffer = NULL;
+  host->contents_cropped = false;
   if (host->contents_shm_mmap) {
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
@@ -158,7 +788,9 @@ static void sl_host_surface_attach(struct wl_client* client,
     buffer_proxy = host_buffer->proxy;
 
     if (!host_buffer->is_drm) {
-      if (host_buffer->shm_mmap)
+      // Imported shm buffers are attached as they are, unless they need to
+      // be composited with the window shape.
+      if (host_buffer->shm_mmap && (!host_buffer->proxy || window_shaped))
         host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
     } else {
       if (window_shaped && host_buffer->shm_mmap) {
@@ -188,44 +820,64 @@ static void sl_host_surface_attach(struct wl_client* client,
   // An output_surface that is shaped will have its format
   // forced to ARGB8888 (hence the changes below)
   if (host->contents_shm_mmap) {
+    uint32_t alloc_width = host_buffer->width;
+    uint32_t alloc_height = host_buffer->height;
+
+    sl_output_buffer_alloc_size(host, host_buffer->shm_format, window_shaped,
+                                &alloc_width, &alloc_height);
+
     while (!wl_list_empty(&host->released_buffers)) {
       host->current_buffer = wl_container_of(host->released_buffers.next,
                                              host->current_buffer, link);
 
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          ((window_shaped && host->current_buffer->shape_image &&
-            host->current_buffer->format == WL_SHM_FORMAT_ARGB8888) ||
-           (!window_shaped &&
-            host->current_buffer->format == host_buffer->shm_format))) {
+      if (sl_output_buffer_matches(host->current_buffer, alloc_width,
+                                   alloc_height, host_buffer->shm_format,
+                                   window_shaped)) {
         break;
       }
 
-      sl_output_buffer_destroy(host->current_buffer);
+      sl_output_buffer_pool_put(host->ctx, host->current_buffer);
       host->current_buffer = NULL;
     }
 
+    // Reuse a buffer given up by another surface, or by this one.
+    if (!host->current_buffer) {
+      host->current_buffer = sl_output_buffer_pool_take(
+          host, alloc_width, alloc_height, host_buffer->shm_format,
+          window_shaped);
+    }
+
     // Allocate new output buffer.
     if (!host->current_buffer) {
       TRACE_EVENT("surface", "sl_host_surface_attach: allocate_buffer",
                   "dmabuf_enabled", host->ctx->channel->supports_dmabuf());
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
+      size_t width = alloc_width;
+      size_t height = alloc_height;
       uint32_t shm_format =
           window_shaped ? WL_SHM_FORMAT_ARGB8888 : host_buffer->shm_format;
       size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
       size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
 
+      sl_stats_add(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS, 1);
       host->current_buffer = new sl_output_buffer();
       wl_list_insert(&host->released_buffers, &host->current_buffer->link);
       host->current_buffer->width = width;
       host->current_buffer->height = height;
       host->current_buffer->format = shm_format;
-      host->current_buffer->surface = host;
+      host->current_buffer->surface = NULL;
       pixman_region32_init_rect(&host->current_buffer->surface_damage, 0, 0,
                                 MAX_SIZE, MAX_SIZE);
       pixman_region32_init_rect(&host->current_buffer->buffer_damage, 0, 0,
                                 MAX_SIZE, MAX_SIZE);
+      pixman_region32_init(&host->current_buffer->shape);
+      host->current_buffer->shape_valid = false;
+      host->current_buffer->contents_width = 0;
+      host->current_buffer->contents_height = 0;
+      host->current_buffer->release = NULL;
+      host->current_buffer->explicit_release = false;
+      host->current_buffer->is_dmabuf = host->ctx->channel->supports_dmabuf();
+      host->current_buffer->release_fence_fd = -1;
+      host->current_buffer->release_fence_start_ns = 0;
 
       if (window_shaped) {
         host->current_buffer->shape_image = pixman_image_create_bits_no_clear(
@@ -248,7 +900,7 @@ static void sl_host_surface_attach(struct wl_client* client,
         create_info.height = static_cast<__u32>(height);
         create_info.drm_format = sl_drm_format_for_shm_format(shm_format);
 
-        rv = host->ctx->channel->allocate(create_info, create_output);
+        rv = sl_output_buffer_allocate(host->ctx, create_info, create_output);
         if (rv) {
           fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
                   strerror(-rv));
@@ -281,6 +933,8 @@ static void sl_host_surface_attach(struct wl_client* client,
             host->contents_shm_mmap->y_ss[1]);
         host->current_buffer->mmap->begin_write = sl_virtwl_dmabuf_begin_write;
         host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
+        host->current_buffer->copy_kernel =
+            sl_copy_kernel_for_destination(SL_COPY_DESTINATION_HOST_VISIBLE);
       } else {
         size_t size = host->contents_shm_mmap->size;
         struct WaylandBufferCreateInfo create_info = {0};
@@ -293,7 +947,7 @@ static void sl_host_surface_attach(struct wl_client* client,
         create_info.width = size;
         create_info.size = static_cast<__u32>(size);
 
-        rv = host->ctx->channel->allocate(create_info, create_output);
+        rv = sl_output_buffer_allocate(host->ctx, create_info, create_output);
         UNUSED(rv);
 
         pool = wl_shm_create_pool(host->ctx->shm->internal, create_output.fd,
@@ -311,14 +965,54 @@ static void sl_host_surface_attach(struct wl_client* client,
                 host->contents_shm_mmap->offset[0],
             host->contents_shm_mmap->stride[1],
             host->contents_shm_mmap->y_ss[0], host->contents_shm_mmap->y_ss[1]);
+        host->current_buffer->copy_kernel =
+            sl_copy_kernel_for_destination(SL_COPY_DESTINATION_CACHED);
       }
 
       assert(host->current_buffer->internal);
       assert(host->current_buffer->mmap);
 
+      sl_output_buffer_set_surface(host->current_buffer, host);
+      sl_host_surface_enforce_memory_limit(host);
+
+      // Take the page faults now, in a single call, instead of one at a time
+      // during the first copy into the buffer. Dma-bufs that map host memory
+      // cannot be populated; once one has failed, only shm is tried.
+      if (host->ctx->prefault_buffers &&
+          !(host->current_buffer->is_dmabuf &&
+            host->ctx->prefault_dmabuf_unsupported)) {
+        struct sl_mmap* mmap = host->current_buffer->mmap;
+        size_t size = mmap->size + mmap->offset[0];
+
+        TRACE_EVENT("surface", "sl_host_surface_attach: prefault");
+        if (sl_copy_prefault(mmap->addr, size)) {
+          sl_stats_add(SL_STAT_PREFAULT_BYTES, size);
+        } else {
+          sl_stats_add(SL_STAT_PREFAULT_FAILURES, 1);
+          if (host->current_buffer->is_dmabuf) {
+            host->ctx->prefault_dmabuf_unsupported = true;
+            fprintf(stderr,
+                    "warning: dma-buf output buffers cannot be faulted in "
+                    "(%s), only shm ones will be\n",
+                    strerror(errno));
+          }
+        }
+      }
+
       wl_buffer_add_listener(host->current_buffer->internal,
                              &sl_output_buffer_listener, host->current_buffer);
     }
+
+    host->contents_cropped =
+        host->current_buffer->width != host_buffer->width ||
+        host->current_buffer->height != host_buffer->height;
+
+    // A buffer last filled at another size holds stale pixels where the
+    // contents grew, which the client does not have to damage.
+    if (host->current_buffer->contents_width != host_buffer->width ||
+        host->current_buffer->contents_height != host_buffer->height) {
+      sl_output_buffer_damage_all(host->current_buffer);
+    }
   }
 
   sl_transform_guest_to_host(host->ctx, host, &x, &y);
@@ -330,48 +1024,36 @@ static void sl_host_surface_attach(struct wl_client* client,
 
   if (host_buffer && host_buffer->sync_point) {
     TRACE_EVENT("surface", "sl_host_surface_attach: sync_point");
-    dma_buf_sync_file sync_file;
-
-    bool needs_sync = true;
-    if (host->surface_sync) {
-      int ret = 0;
-      sync_file.flags = DMA_BUF_SYNC_READ;
-      do {
-        ret = ioctl(host_buffer->sync_point->fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE,
-                    &sync_file);
-      } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
-
-      if (!ret) {
-        zwp_linux_surface_synchronization_v1_set_acquire_fence(
-            host->surface_sync, sync_file.fd);
-        close(sync_file.fd);
-        needs_sync = false;
-      } else if (ret == -1 && errno == ENOTTY) {
-        // export sync file ioctl not implemented. Revert to previous method of
-        // guest side sync going forward.
-        zwp_linux_surface_synchronization_v1_destroy(host->surface_sync);
-        host->surface_sync = NULL;
-        fprintf(stderr,
-                "DMA_BUF_IOCTL_EXPORT_SYNC_FILE not implemented, defaulting "
-                "to implicit fence for synchronization.\n");
-      } else {
-        fprintf(stderr,
-                "Explicit synchronization failed with reason: %s. "
-                "Will retry on next attach.\n",
-                strerror(errno));
-      }
-    }
 
-    if (needs_sync) {
+    int fence_fd = -1;
+
+    // With explicit sync the host waits for the fence, otherwise we wait for
+    // it on the event loop, or block if no fence can be exported.
+    if (host->surface_sync || host->ctx->async_fence_wait)
+      fence_fd = sl_sync_point_export_fence(host->ctx, host_buffer->sync_point);
+
+    if (fence_fd >= 0 && host->surface_sync) {
+      zwp_linux_surface_synchronization_v1_set_acquire_fence(host->surface_sync,
+                                                             fence_fd);
+      close(fence_fd);
+    } else if (fence_fd >= 0) {
+      sl_host_surface_set_acquire_fence(host, fence_fd);
+    } else {
+      uint64_t start = sl_monotonic_time_ns();
+
       host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+      host->acquire_fence_wait_ns = sl_monotonic_time_ns() - start;
+      sl_stats_add(SL_STAT_GPU_WAIT_BLOCKED_NS, host->acquire_fence_wait_ns);
     }
   }
 
   if (host->current_buffer) {
     assert(host->current_buffer->internal);
     wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
+    host->current_buffer_attached = true;
   } else {
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
+    host->current_buffer_attached = false;
   }
 
   wl_list_for_each(window, &host->ctx->windows, link) {
@@ -424,6 +1106,73 @@ void compute_buffer_scale_and_offset(const sl_host_surface* host,
   *out_offset_y = offset_y;
 }
 
+// Forwards damage in surface coordinates to the host.
+static void sl_host_surface_forward_damage(struct sl_host_surface* host,
+                                           int32_t x,
+                                           int32_t y,
+                                           int32_t width,
+                                           int32_t height) {
+  int64_t x1 = x;
+  int64_t y1 = y;
+  int64_t x2 = x1 + width;
+  int64_t y2 = y1 + height;
+
+  sl_transform_damage_coord(host->ctx, host, 1.0, 1.0, &x1, &y1, &x2, &y2);
+  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+}
+
+// Forwards damage in buffer coordinates to the host.
+static void sl_host_surface_forward_damage_buffer(struct sl_host_surface* host,
+                                                  int32_t x,
+                                                  int32_t y,
+                                                  int32_t width,
+                                                  int32_t height) {
+  // Forward wl_surface_damage() call to the host. Since the damage region is
+  // given in buffer pixel coordinates, convert to surface coordinates first.
+  // If the host supports wl_surface_damage_buffer one day, we can avoid this
+  // conversion.
+  double scale_x, scale_y;
+  wl_fixed_t offset_x, offset_y;
+  struct sl_viewport* viewport = NULL;
+  if (!wl_list_empty(&host->contents_viewport))
+    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+
+  compute_buffer_scale_and_offset(host, viewport, &scale_x, &scale_y, &offset_x,
+                                  &offset_y);
+
+  int64_t x1 = x - wl_fixed_to_int(offset_x);
+  int64_t y1 = y - wl_fixed_to_int(offset_y);
+  int64_t x2 = x1 + width;
+  int64_t y2 = y1 + height;
+
+  sl_transform_damage_coord(host->ctx, host, scale_x, scale_y, &x1, &y1, &x2,
+                            &y2);
+  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+}
+
+// Forwards damage held back by --tile-hash-damage to the host.
+static void sl_host_surface_forward_deferred_damage(
+    struct sl_host_surface* host) {
+  pixman_box32_t* rect;
+  int n;
+
+  rect = pixman_region32_rectangles(&host->deferred_surface_damage, &n);
+  while (n--) {
+    sl_host_surface_forward_damage(host, rect->x1, rect->y1,
+                                   rect->x2 - rect->x1, rect->y2 - rect->y1);
+    ++rect;
+  }
+  rect = pixman_region32_rectangles(&host->deferred_buffer_damage, &n);
+  while (n--) {
+    sl_host_surface_forward_damage_buffer(
+        host, rect->x1, rect->y1, rect->x2 - rect->x1, rect->y2 - rect->y1);
+    ++rect;
+  }
+
+  pixman_region32_clear(&host->deferred_surface_damage);
+  pixman_region32_clear(&host->deferred_buffer_damage);
+}
+
 static void sl_host_surface_damage(struct wl_client* client,
                                    struct wl_resource* resource,
                                    int32_t x,
@@ -432,11 +1181,11 @@ static void sl_host_surface_damage(struct wl_client* client,
                                    int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+  sl_host_surface_flush(host);
 
   struct sl_output_buffer* buffer;
-  int64_t x1, y1, x2, y2;
 
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->surface_damage, &buffer->surface_damage,
@@ -447,13 +1196,14 @@ static void sl_host_surface_damage(struct wl_client* client,
                                x, y, width, height);
   }
 
-  x1 = x;
-  y1 = y;
-  x2 = x1 + width;
-  y2 = y1 + height;
+  if (host->ctx->tile_hash_damage) {
+    pixman_region32_union_rect(&host->deferred_surface_damage,
+                               &host->deferred_surface_damage, x, y, width,
+                               height);
+    return;
+  }
 
-  sl_transform_damage_coord(host->ctx, host, 1.0, 1.0, &x1, &y1, &x2, &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  sl_host_surface_forward_damage(host, x, y, width, height);
 }
 
 static void sl_host_surface_damage_buffer(struct wl_client* client,
@@ -464,10 +1214,12 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
                                           int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage_buffer", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
   struct sl_output_buffer* buffer;
 
+  sl_host_surface_flush(host);
+
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->buffer_damage, &buffer->buffer_damage,
                                x, y, width, height);
@@ -477,27 +1229,14 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
                                x, y, width, height);
   }
 
-  // Forward wl_surface_damage() call to the host. Since the damage region is
-  // given in buffer pixel coordinates, convert to surface coordinates first.
-  // If the host supports wl_surface_damage_buffer one day, we can avoid this
-  // conversion.
-  double scale_x, scale_y;
-  wl_fixed_t offset_x, offset_y;
-  struct sl_viewport* viewport = NULL;
-  if (!wl_list_empty(&host->contents_viewport))
-    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
-
-  compute_buffer_scale_and_offset(host, viewport, &scale_x, &scale_y, &offset_x,
-                                  &offset_y);
-
-  int64_t x1 = x - wl_fixed_to_int(offset_x);
-  int64_t y1 = y - wl_fixed_to_int(offset_y);
-  int64_t x2 = x1 + width;
-  int64_t y2 = y1 + height;
+  if (host->ctx->tile_hash_damage) {
+    pixman_region32_union_rect(&host->deferred_buffer_damage,
+                               &host->deferred_buffer_damage, x, y, width,
+                               height);
+    return;
+  }
 
-  sl_transform_damage_coord(host->ctx, host, scale_x, scale_y, &x1, &y1, &x2,
-                            &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  sl_host_surface_forward_damage_buffer(host, x, y, width, height);
 }
 
 static void sl_frame_callback_done(void* data,
@@ -533,6 +1272,8 @@ static void sl_host_surface_frame(struct wl_client* client,
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
   struct sl_host_callback* host_callback = new sl_host_callback();
 
+  sl_host_surface_flush(host);
+
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
@@ -542,68 +1283,419 @@ static void sl_host_surface_frame(struct wl_client* client,
                            host_callback);
 }
 
-static void copy_damaged_rect(sl_host_surface* host,
-                              pixman_box32_t* rect,
-                              bool shaped,
-                              double scale_x,
-                              double scale_y,
-                              double offset_x,
-                              double offset_y) {
-  uint8_t* src_addr = static_cast<uint8_t*>(host->contents_shm_mmap->addr);
-  uint8_t* dst_addr = static_cast<uint8_t*>(host->current_buffer->mmap->addr);
-  size_t* src_offset = host->contents_shm_mmap->offset;
-  size_t* dst_offset = host->current_buffer->mmap->offset;
-  size_t* src_stride = host->contents_shm_mmap->stride;
-  size_t* dst_stride = host->current_buffer->mmap->stride;
-  size_t* y_ss = host->contents_shm_mmap->y_ss;
-  size_t bpp = host->contents_shm_mmap->bpp;
-  size_t num_planes = host->contents_shm_mmap->num_planes;
-  int32_t x1, y1, x2, y2;
-  size_t null_set[3] = {0, 0, 0};
-  size_t shape_stride[3] = {0, 0, 0};
+static void sl_output_buffer_copy_job(sl_host_surface* host,
+                                      bool shaped,
+                                      struct sl_copy_job* job) {
+  struct sl_mmap* src = host->contents_shm_mmap;
+  struct sl_mmap* dst = host->current_buffer->mmap;
+
+  // Only shaped contents are mapped partially, and those are copied from
+  // the shape image.
+  assert(shaped || (!src->rect_x && !src->rect_y));
+  job->kernel = host->current_buffer->copy_kernel;
+  job->src_addr = static_cast<uint8_t*>(src->addr);
+  job->dst_addr = static_cast<uint8_t*>(dst->addr);
+  job->bpp = src->bpp;
+  job->num_planes = src->num_planes;
+  job->width = host->contents_width;
+  job->height = host->contents_height;
+  for (size_t i = 0; i < 2; ++i) {
+    job->src_offset[i] = src->offset[i];
+    job->src_stride[i] = src->stride[i];
+    job->dst_offset[i] = dst->offset[i];
+    job->dst_stride[i] = dst->stride[i];
+    job->y_ss[i] = src->y_ss[i];
+  }
 
   if (shaped) {
     // If we are copying from a shaped window, the actual image data
     // we want comes from the shape_image. We are making the modifications
     // here so the source data comes from this buffer.
-    src_addr = reinterpret_cast<uint8_t*>(
+    job->src_addr = reinterpret_cast<uint8_t*>(
         pixman_image_get_data(host->current_buffer->shape_image));
-    src_offset = null_set;
-    src_stride = shape_stride;
-
-    shape_stride[0] =
+    job->src_offset[0] = job->src_offset[1] = 0;
+    job->src_stride[0] =
         pixman_image_get_stride(host->current_buffer->shape_image);
+    job->src_stride[1] = 0;
   }
+}
 
-  // Enclosing rect after applying scale and offset.
-  x1 = rect->x1 * scale_x + offset_x;
-  y1 = rect->y1 * scale_y + offset_y;
-  x2 = rect->x2 * scale_x + offset_x + 0.5;
-  y2 = rect->y2 * scale_y + offset_y + 0.5;
-
-  x1 = MAX(0, x1);
-  y1 = MAX(0, y1);
-  x2 = MIN(static_cast<int32_t>(host->contents_width), x2);
-  y2 = MIN(static_cast<int32_t>(host->contents_height), y2);
-
-  if (x1 < x2 && y1 < y2) {
-    size_t i;
-
-    for (i = 0; i < num_planes; ++i) {
-      uint8_t* src_base = src_addr + src_offset[i];
-      uint8_t* dst_base = dst_addr + dst_offset[i];
-      uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
-      uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
-      int32_t width = x2 - x1;
-      int32_t height = (y2 - y1) / y_ss[i];
-      size_t bytes = width * bpp;
-
-      while (height--) {
-        memcpy(dst, src, bytes);
-        dst += dst_stride[i];
-        src += src_stride[i];
+static struct sl_copy_pool* sl_compositor_copy_pool(struct sl_context* ctx) {
+  if (!ctx->copy_pool && ctx->copy_threads > 0)
+    ctx->copy_pool = sl_copy_pool_create(ctx->copy_threads);
+  return ctx->copy_pool;
+}
+
+// Computes the damaged region of the buffer by transforming `surface_damage`
+// into buffer coordinates and merging it with `buffer_damage`.
+static void sl_output_buffer_damage(sl_host_surface* host,
+                                    double scale_x,
+                                    double scale_y,
+                                    double offset_x,
+                                    double offset_y,
+                                    pixman_region32_t* surface_damage,
+                                    pixman_region32_t* buffer_damage,
+                                    pixman_region32_t* damage,
+                                    uint32_t* rects_in) {
+  pixman_box32_t* rect;
+  int n;
+
+  pixman_region32_copy(damage, buffer_damage);
+  *rects_in = pixman_region32_n_rects(damage);
+
+  rect = pixman_region32_rectangles(surface_damage, &n);
+  *rects_in += n;
+  while (n--) {
+    // Enclosing rect after applying scale and offset.
+    int32_t x1 = rect->x1 * scale_x + offset_x;
+    int32_t y1 = rect->y1 * scale_y + offset_y;
+    int32_t x2 = rect->x2 * scale_x + offset_x + 0.5;
+    int32_t y2 = rect->y2 * scale_y + offset_y + 0.5;
+
+    x1 = MAX(0, x1);
+    y1 = MAX(0, y1);
+    x2 = MIN(static_cast<int32_t>(host->contents_width), x2);
+    y2 = MIN(static_cast<int32_t>(host->contents_height), y2);
+    if (x1 < x2 && y1 < y2)
+      pixman_region32_union_rect(damage, damage, x1, y1, x2 - x1, y2 - y1);
+    ++rect;
+  }
+}
+
+// Returns true if the shape image of the current buffer has to be generated
+// again from scratch.
+static bool sl_output_buffer_shape_changed(sl_host_surface* host) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+
+  return !buffer->shape_valid ||
+         !pixman_region32_equal(&buffer->shape, &host->contents_shape);
+}
+
+// Brings the shape image of the current buffer up to date before `damage`,
+// in buffer coordinates, is copied from it. Only damaged pixels are
+// generated again, unless the shape changed since the buffer was last used.
+// Pixels whose side of the shape changed are then added to `damage`.
+static void sl_output_buffer_update_shape_image(sl_host_surface* host,
+                                                pixman_region32_t* damage) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+  pixman_region32_t* generate = damage;
+  pixman_region32_t changed;
+
+  pixman_region32_init(&changed);
+  if (!buffer->shape_valid) {
+    generate = NULL;
+    pixman_region32_union_rect(&changed, &changed, 0, 0, buffer->width,
+                               buffer->height);
+  } else if (sl_output_buffer_shape_changed(host)) {
+    pixman_region32_t both;
+
+    generate = NULL;
+    pixman_region32_init(&both);
+    pixman_region32_union(&changed, &buffer->shape, &host->contents_shape);
+    pixman_region32_intersect(&both, &buffer->shape, &host->contents_shape);
+    pixman_region32_subtract(&changed, &changed, &both);
+    pixman_region32_fini(&both);
+  }
+
+  TRACE_EVENT("surface", "sl_output_buffer_update_shape_image", "full",
+              generate == NULL);
+  sl_xshape_generate_argb_image(host->ctx, &host->contents_shape,
+                                host->contents_shm_mmap, buffer->shape_image,
+                                host->contents_shm_format, generate);
+  pixman_region32_union(damage, damage, &changed);
+  pixman_region32_fini(&changed);
+
+  pixman_region32_copy(&buffer->shape, &host->contents_shape);
+  buffer->shape_valid = true;
+}
+
+// Begins access to the client's contents of a shaped surface. DRM PRIME
+// buffers only have the part read back that is needed to update the current
+// output buffer: the extents of its damage, or everything if the shape image
+// has to be generated again.
+static bool sl_host_surface_begin_shaped_access(sl_host_surface* host,
+                                                struct sl_viewport* viewport) {
+  struct sl_mmap* map = host->contents_shm_mmap;
+  double scale_x, scale_y;
+  wl_fixed_t offset_x, offset_y;
+  pixman_region32_t damage;
+  pixman_box32_t* extents;
+  uint32_t rects_in;
+  int32_t x1 = 0, y1 = 0;
+  int32_t x2 = host->contents_width, y2 = host->contents_height;
+
+  if (map->map_type != SL_MMAP_DRM_PRIME ||
+      sl_output_buffer_shape_changed(host)) {
+    return sl_mmap_begin_access(map);
+  }
+
+  compute_buffer_scale_and_offset(host, viewport, &scale_x, &scale_y, &offset_x,
+                                  &offset_y);
+  pixman_region32_init(&damage);
+  sl_output_buffer_damage(host, scale_x, scale_y, wl_fixed_to_double(offset_x),
+                          wl_fixed_to_double(offset_y),
+                          &host->current_buffer->surface_damage,
+                          &host->current_buffer->buffer_damage, &damage,
+                          &rects_in);
+  pixman_region32_intersect_rect(&damage, &damage, x1, y1, x2, y2);
+  if (pixman_region32_not_empty(&damage)) {
+    extents = pixman_region32_extents(&damage);
+    x1 = extents->x1;
+    y1 = extents->y1;
+    x2 = extents->x2;
+    y2 = extents->y2;
+  } else {
+    // Nothing is read, but a mapping is still made to check that the
+    // buffer can be accessed.
+    x2 = MIN(x2, 1);
+    y2 = MIN(y2, 1);
+  }
+  pixman_region32_fini(&damage);
+
+  TRACE_EVENT("surface", "sl_host_surface_begin_shaped_access", "width",
+              x2 - x1, "height", y2 - y1);
+  return sl_mmap_begin_access_rect(map, x1, y1, x2 - x1, y2 - y1);
+}
+
+// Returns the number of pixels of `region` within the first `width` x
+// `height` pixels.
+static uint64_t sl_region_area(pixman_region32_t* region,
+                               int32_t width,
+                               int32_t height) {
+  pixman_box32_t* rect;
+  uint64_t area = 0;
+  int n;
+
+  rect = pixman_region32_rectangles(region, &n);
+  while (n--) {
+    int32_t x1 = MAX(0, rect->x1);
+    int32_t y1 = MAX(0, rect->y1);
+    int32_t x2 = MIN(width, rect->x2);
+    int32_t y2 = MIN(height, rect->y2);
+
+    if (x1 < x2 && y1 < y2)
+      area += static_cast<uint64_t>(x2 - x1) * (y2 - y1);
+    ++rect;
+  }
+  return area;
+}
+
+// Drops tiles whose contents did not change from the copy `damage`, and from
+// the damage held back for the host, which is left in buffer coordinates for
+// sl_host_surface_forward_deferred_damage().
+static void sl_host_surface_reduce_damage(sl_host_surface* host,
+                                          double scale_x,
+                                          double scale_y,
+                                          double offset_x,
+                                          double offset_y,
+                                          const struct sl_copy_job* job,
+                                          pixman_region32_t* damage) {
+  pixman_region32_t host_damage;
+  uint32_t rects_in;
+  uint64_t pixels_in, pixels_out;
+
+  if (!host->tile_hashes)
+    host->tile_hashes = new sl_copy_tile_hashes();
+
+  pixman_region32_init(&host_damage);
+  sl_output_buffer_damage(host, scale_x, scale_y, offset_x, offset_y,
+                          &host->deferred_surface_damage,
+                          &host->deferred_buffer_damage, &host_damage,
+                          &rects_in);
+  pixman_region32_clear(&host->deferred_surface_damage);
+
+  pixels_in = sl_region_area(damage, job->width, job->height);
+  sl_copy_reduce_damage(job, sl_copy_hash_kernel(), damage,
+                        &host->current_buffer->tile_hashes, &host_damage,
+                        host->tile_hashes);
+  pixels_out = sl_region_area(damage, job->width, job->height);
+  pixman_region32_copy(&host->deferred_buffer_damage, &host_damage);
+
+  TRACE_EVENT("surface", "sl_host_surface_reduce_damage", "pixels_in",
+              pixels_in, "pixels_out", pixels_out, "host_rects_out",
+              pixman_region32_n_rects(&host_damage));
+  pixman_region32_fini(&host_damage);
+
+  host->tile_damage_pixels_in = pixels_in;
+  host->tile_damage_pixels_out = pixels_out;
+  sl_stats_add(SL_STAT_TILE_DAMAGE_PIXELS_IN, pixels_in);
+  sl_stats_add(SL_STAT_TILE_DAMAGE_PIXELS_OUT, pixels_out);
+}
+
+static int sl_handle_copy_queue_event(int fd, uint32_t mask, void* data);
+
+static struct sl_copy_queue* sl_compositor_copy_queue(struct sl_context* ctx) {
+  if (!ctx->copy_queue && ctx->async_commit) {
+    ctx->copy_queue = sl_copy_queue_create(sl_compositor_copy_pool(ctx),
+                                           ctx->copy_parallel_threshold);
+    ctx->copy_queue_event_source.reset(wl_event_loop_add_fd(
+        wl_display_get_event_loop(ctx->host_display),
+        sl_copy_queue_fd(ctx->copy_queue), WL_EVENT_READABLE,
+        sl_handle_copy_queue_event, ctx));
+  }
+  return ctx->copy_queue;
+}
+
+// Commits the pending state of `host` to the host. If `buffer` was attached
+// since the last commit, the host is asked to release it with a fence rather
+// than through wl_buffer.release, so that it can be reused as soon as it is
+// queued for the host's GPU. Explicit releases are only available for
+// dma-bufs; other buffers, and dma-bufs on surfaces without explicit sync,
+// rely on wl_buffer.release for this commit.
+static void sl_host_surface_commit_buffer(struct sl_host_surface* host,
+                                          struct sl_output_buffer* buffer) {
+  if (buffer && host->current_buffer_attached && !buffer->release) {
+    buffer->explicit_release = false;
+    if (host->surface_sync && buffer->is_dmabuf) {
+      buffer->release =
+          zwp_linux_surface_synchronization_v1_get_release(host->surface_sync);
+      zwp_linux_buffer_release_v1_add_listener(
+          buffer->release, &sl_output_buffer_release_listener, buffer);
+      buffer->explicit_release = true;
+    }
+  }
+  host->current_buffer_attached = false;
+  wl_surface_commit(host->proxy);
+}
+
+void sl_host_surface_commit_to_host(struct sl_host_surface* host) {
+  sl_host_surface_commit_buffer(host, host->current_buffer);
+}
+
+// Forwards a commit to the host once its damage has been copied into
+// `buffer`, then releases the client's buffer `contents`. Both may be NULL.
+static void sl_host_surface_commit_finish(struct sl_host_surface* host,
+                                          struct sl_output_buffer* buffer,
+                                          struct sl_mmap* contents) {
+  uint32_t resource_id = try_wl_resource_get_id(host->resource);
+
+  if (buffer && buffer->mmap->end_write)
+    buffer->mmap->end_write(buffer->mmap->fd, host->ctx);
+
+  // No need to defer client commits if surface has a role. E.g. is a cursor
+  // or shell surface.
+  if (host->has_role) {
+    TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
+                "resource_id", resource_id, "has_role", host->has_role);
+    sl_host_surface_commit_buffer(host, buffer);
+
+    // GTK determines the scale based on the output the surface has entered.
+    // If the surface has not entered any output, then have it enter the
+    // internal output. TODO(reveman): Remove this when surface-output tracking
+    // has been implemented in Chrome.
+    if (!host->has_output) {
+      struct sl_host_output* output;
+
+      wl_list_for_each(output, &host->ctx->host_outputs, link) {
+        if (output->internal) {
+          wl_surface_send_enter(host->resource, output->resource);
+          host->has_output = 1;
+          break;
+        }
       }
     }
+  } else {
+    TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
+                "resource_id", resource_id, "has_role", host->has_role);
+    // Commit if surface is associated with a window. Otherwise, defer
+    // commit until window is created.
+    struct sl_window* window;
+    wl_list_for_each(window, &host->ctx->windows, link) {
+      if (window->host_surface_id == resource_id) {
+        if (window->xdg_surface) {
+          sl_host_surface_commit_buffer(host, buffer);
+          if (host->contents_width && host->contents_height)
+            window->realized = 1;
+        }
+        break;
+      }
+    }
+  }
+
+  if (contents) {
+    if (contents->buffer_resource) {
+      wl_buffer_send_release(contents->buffer_resource);
+    }
+    sl_mmap_end_access(contents);
+    sl_mmap_unref(contents);
+  }
+}
+
+// Finishes pending commits, oldest first, until one is found whose copy is
+// still in progress.
+static void sl_compositor_complete_commits(struct sl_context* ctx) {
+  while (!wl_list_empty(&ctx->pending_commits)) {
+    struct sl_pending_commit* pending = wl_container_of(
+        ctx->pending_commits.next, pending, link);
+
+    if (pending->fenced)
+      break;
+    if (pending->ticket) {
+      uint64_t ticket;
+      size_t bytes_copied;
+
+      // Copies complete in submission order, so the oldest completed copy
+      // belongs to the oldest pending commit that has one.
+      if (!sl_copy_queue_poll(ctx->copy_queue, &ticket, &bytes_copied))
+        break;
+      assert(ticket == pending->ticket);
+      pending->host->damage_bytes_copied = bytes_copied;
+    }
+
+    TRACE_EVENT("surface", "sl_compositor_complete_commits", "resource_id",
+                try_wl_resource_get_id(pending->host->resource));
+    wl_list_remove(&pending->link);
+    --pending->host->pending_commits;
+    sl_host_surface_commit_finish(pending->host, pending->buffer,
+                                  pending->contents);
+    delete pending;
+  }
+}
+
+static int sl_handle_copy_queue_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = static_cast<struct sl_context*>(data);
+
+  sl_compositor_complete_commits(ctx);
+  return 1;
+}
+
+void sl_host_surface_flush(struct sl_host_surface* host) {
+  if (!host->pending_commits)
+    return;
+
+  TRACE_EVENT("surface", "sl_host_surface_flush", "resource_id",
+              try_wl_resource_get_id(host->resource));
+
+  while (host->pending_commits) {
+    struct sl_pending_commit* pending;
+    struct sl_host_surface* fenced = NULL;
+    uint64_t newest = 0;
+    uint64_t ticket = 0;
+    int left = host->pending_commits;
+
+    // Find what the surface's commits depend on: the fences of commits held
+    // back up to its last pending commit, and the newest copy submitted by
+    // then.
+    wl_list_for_each(pending, &host->ctx->pending_commits, link) {
+      newest = MAX(newest, pending->ticket);
+      if (pending->fenced && !fenced)
+        fenced = pending->host;
+      if (pending->host == host && !--left) {
+        ticket = newest;
+        break;
+      }
+    }
+
+    // Signaling a fence completes the commits it held up, which may be
+    // enough. Otherwise look again for what is left.
+    if (fenced) {
+      sl_host_surface_wait_acquire_fence(fenced);
+      continue;
+    }
+    if (ticket)
+      sl_copy_queue_wait(host->ctx->copy_queue, ticket);
+    sl_compositor_complete_commits(host->ctx);
+    assert(!host->pending_commits);
   }
 }
 
@@ -619,15 +1711,31 @@ static void sl_host_surface_commit(struct wl_client* client,
     host->ctx->timing->UpdateLastCommit(resource_id);
   }
   struct sl_viewport* viewport = NULL;
+  struct sl_copy_queue* copy_queue = sl_compositor_copy_queue(host->ctx);
+  struct sl_output_buffer* copied_buffer = NULL;
+  uint64_t ticket = 0;
 
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
 
+  // The viewport state sent below applies to this commit. wp_viewport
+  // requests are not forwarded as they arrive, so earlier commits of the
+  // surface still waiting for their copy have not been flushed for them.
+  if (host->pending_commits)
+    sl_host_surface_flush(host);
+
+  // Shaped DRM contents are read back below, which has to wait for the GPU.
+  if (host->contents_shm_mmap)
+    sl_host_surface_wait_acquire_fence(host);
+
   // We are doing this check outside the contents_shm_mmap check below so
   // we can bail out on the shaped processing of a DRM buffer in case mapping
   // it fails.
   if (host->contents_shm_mmap) {
-    bool mmap_ensured = sl_mmap_begin_access(host->contents_shm_mmap);
+    bool mmap_ensured =
+        host->contents_shaped
+            ? sl_host_surface_begin_shaped_access(host, viewport)
+            : sl_mmap_begin_access(host->contents_shm_mmap);
 
     if (!mmap_ensured) {
       // Clean up anything left from begin_access
@@ -642,26 +1750,21 @@ static void sl_host_surface_commit(struct wl_client* client,
         // Release the allocated output buffer back to the queue
         host->contents_shm_mmap = NULL;
         host->contents_shaped = false;
+        host->contents_cropped = false;
         pixman_region32_clear(&host->contents_shape);
-        sl_output_buffer_release(NULL, host->current_buffer->internal);
+        sl_output_buffer_released(host->current_buffer);
 
         // Attach the original buffer back, ensure proxy_buffer is not NULL
         assert(host->proxy_buffer);
         wl_surface_attach(host->proxy, host->proxy_buffer,
                           host->contents_x_offset, host->contents_y_offset);
+        host->current_buffer_attached = false;
       } else {
         // If we are not shaped, we will still need access to the buffer in this
         // case. We shouldn't get here. We are using this assert to provide some
         // clues within error logs that may result from hitting this point.
         assert(mmap_ensured);
       }
-    } else {
-      // In this case, perform the image manipulation if we are dealing
-      // with a shaped surface.
-      if (host->contents_shaped)
-        sl_xshape_generate_argb_image(
-            host->ctx, &host->contents_shape, host->contents_shm_mmap,
-            host->current_buffer->shape_image, host->contents_shm_format);
     }
   }
 
@@ -676,44 +1779,79 @@ static void sl_host_surface_commit(struct wl_client* client,
       host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd,
                                               host->ctx);
 
-    // Copy damaged regions (surface-relative coordinates).
-    int n;
-    pixman_box32_t* rect =
-        pixman_region32_rectangles(&host->current_buffer->surface_damage, &n);
-    while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (surface damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, contents_scale_x,
-                        contents_scale_y, wl_fixed_to_double(contents_offset_x),
-                        wl_fixed_to_double(contents_offset_y));
-      ++rect;
+    // Copy the union of surface and buffer damage, so that no pixel is
+    // copied twice when a client uses both.
+    struct sl_copy_job job;
+    pixman_region32_t damage;
+    std::vector<sl_copy_span> spans;
+    uint32_t rects_in;
+
+    pixman_region32_init(&damage);
+    sl_output_buffer_damage(host, contents_scale_x, contents_scale_y,
+                            wl_fixed_to_double(contents_offset_x),
+                            wl_fixed_to_double(contents_offset_y),
+                            &host->current_buffer->surface_damage,
+                            &host->current_buffer->buffer_damage, &damage,
+                            &rects_in);
+    if (host->contents_shaped)
+      sl_output_buffer_update_shape_image(host, &damage);
+    sl_output_buffer_copy_job(host, host->contents_shaped, &job);
+    if (host->ctx->tile_hash_damage) {
+      sl_host_surface_reduce_damage(host, contents_scale_x, contents_scale_y,
+                                    wl_fixed_to_double(contents_offset_x),
+                                    wl_fixed_to_double(contents_offset_y),
+                                    &job, &damage);
     }
-
-    // Copy damaged regions (buffer-relative coordinates).
-    //
-    // In theory, if we've accumulated both surface damage and buffer damage,
-    // it might be more efficient to first transform and union the regions, so
-    // that we won't ever copy the same pixel twice.
-    // In practice, wl_surface::damage_buffer obsoletes wl_surface::damage, and
-    // it doesn't seem worthwhile to optimize for the edge case in which an app
-    // uses both in the same frame.
-    rect = pixman_region32_rectangles(&host->current_buffer->buffer_damage, &n);
-    while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (buffer damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, 1.0, 1.0, 0.0, 0.0);
-      ++rect;
+    sl_copy_plan(&job, &damage, &spans);
+    pixman_region32_fini(&damage);
+
+    host->damage_rects_in = rects_in;
+    host->damage_rects_out = spans.size();
+
+    if (copy_queue && (!wl_list_empty(&host->ctx->pending_commits) ||
+                       sl_copy_plan_bytes(&job, spans) >=
+                           ASYNC_COMMIT_MIN_BYTES)) {
+      // The buffer and client contents stay referenced by the pending
+      // commit until the copy has completed.
+      ticket = sl_copy_queue_submit(copy_queue, &job, std::move(spans));
+    } else {
+      TRACE_EVENT("surface", "sl_host_surface_commit: memcpy_loop",
+                  "rects_in", rects_in, "rects_out", spans.size());
+      // With --async-commit the pool belongs to the copy thread.
+      host->damage_bytes_copied = sl_copy_pool_run(
+          copy_queue ? NULL : sl_compositor_copy_pool(host->ctx), &job, spans,
+          host->ctx->copy_parallel_threshold);
     }
-
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd,
-                                            host->ctx);
+    copied_buffer = host->current_buffer;
+    copied_buffer->contents_width = host->contents_width;
+    copied_buffer->contents_height = host->contents_height;
 
     pixman_region32_clear(&host->current_buffer->surface_damage);
     pixman_region32_clear(&host->current_buffer->buffer_damage);
 
     wl_list_remove(&host->current_buffer->link);
     wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+
+    uint64_t now = sl_monotonic_time_ns();
+    if (host->last_commit_ns) {
+      host->commit_interval_ns = sl_moving_average(host->commit_interval_ns,
+                                                   now - host->last_commit_ns);
+    }
+    host->last_commit_ns = now;
+    host->current_buffer->commit_time_ns = now;
+    sl_host_surface_update_queue_depth(host);
+    sl_host_surface_trim_buffers(host);
+  }
+
+  // Without a copy there is nothing to compare, so all damage is forwarded.
+  // The host may then be showing contents we have not hashed.
+  if (host->ctx->tile_hash_damage) {
+    if (!copied_buffer && host->tile_hashes &&
+        (pixman_region32_not_empty(&host->deferred_surface_damage) ||
+         pixman_region32_not_empty(&host->deferred_buffer_damage))) {
+      sl_copy_tile_hashes_reset(host->tile_hashes, 0, 0);
+    }
+    sl_host_surface_forward_deferred_damage(host);
   }
 
   if (host->contents_width && host->contents_height) {
@@ -723,6 +1861,8 @@ static void sl_host_surface_commit(struct wl_client* client,
       int width = host->contents_width;
       int height = host->contents_height;
 
+      bool source_set = false;
+
       // We need to take the client's viewport into account while still
       // making sure our scale is accounted for.
       if (viewport) {
@@ -731,6 +1871,7 @@ static void sl_host_surface_commit(struct wl_client* client,
           wp_viewport_set_source(host->viewport, viewport->src_x,
                                  viewport->src_y, viewport->src_width,
                                  viewport->src_height);
+          source_set = true;
 
           // If the source rectangle is set and the destination size is not
           // set, then src_width and src_height should be integers, and the
@@ -746,6 +1887,25 @@ static void sl_host_surface_commit(struct wl_client* client,
         }
       }
 
+      // The client's source rectangle is already relative to the top-left
+      // corner that holds the contents of an oversized output buffer.
+      // Otherwise crop the buffer to the contents ourselves, and undo that
+      // once the buffer fits again.
+      if (!source_set && host->contents_cropped) {
+        wp_viewport_set_source(host->viewport, wl_fixed_from_int(0),
+                               wl_fixed_from_int(0),
+                               wl_fixed_from_int(host->contents_width),
+                               wl_fixed_from_int(host->contents_height));
+        host->viewport_cropped = true;
+      } else if (!source_set && host->viewport_cropped) {
+        wp_viewport_set_source(host->viewport, wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1));
+        host->viewport_cropped = false;
+      } else if (source_set) {
+        host->viewport_cropped = false;
+      }
+
       int32_t vp_width = width;
       int32_t vp_height = height;
 
@@ -760,54 +1920,43 @@ static void sl_host_surface_commit(struct wl_client* client,
     }
   }
 
-  // No need to defer client commits if surface has a role. E.g. is a cursor
-  // or shell surface.
-  if (host->has_role) {
-    TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
-                "resource_id", resource_id, "has_role", host->has_role);
-    wl_surface_commit(host->proxy);
-
-    // GTK determines the scale based on the output the surface has entered.
-    // If the surface has not entered any output, then have it enter the
-    // internal output. TODO(reveman): Remove this when surface-output tracking
-    // has been implemented in Chrome.
-    if (!host->has_output) {
-      struct sl_host_output* output;
-
-      wl_list_for_each(output, &host->ctx->host_outputs, link) {
-        if (output->internal) {
-          wl_surface_send_enter(host->resource, output->resource);
-          host->has_output = 1;
-          break;
-        }
-      }
-    }
-  } else {
-    TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
-                "resource_id", resource_id, "has_role", host->has_role);
-    // Commit if surface is associated with a window. Otherwise, defer
-    // commit until window is created.
-    struct sl_window* window;
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
-      }
-    }
+  // Hold the commit back until the GPU has finished rendering the attached
+  // buffer. The event loop keeps going in the meantime, but the commit stays
+  // in order with those of other surfaces, so that the state of a
+  // synchronized sub-surface is still applied with its parent's next commit.
+  if (host->acquire_fence_fd >= 0) {
+    assert(!ticket && !copied_buffer && !host->contents_shm_mmap);
+    host->acquire_fence_commit = true;
   }
 
-  if (host->contents_shm_mmap) {
-    if (host->contents_shm_mmap->buffer_resource) {
-      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
-    }
-    sl_mmap_end_access(host->contents_shm_mmap);
-    sl_mmap_unref(host->contents_shm_mmap);
+  sl_host_surface_commit_dispatch(host, ticket, copied_buffer);
+}
+
+// Forwards a commit to the host, or queues it behind the commits still
+// waiting for their copy or acquire fence.
+static void sl_host_surface_commit_dispatch(struct sl_host_surface* host,
+                                            uint64_t ticket,
+                                            struct sl_output_buffer* buffer) {
+  // Commits must reach the host in order. Once one is waiting for its copy
+  // or fence, every later commit waits behind it, even if it has nothing to
+  // copy.
+  if (ticket || host->acquire_fence_commit ||
+      !wl_list_empty(&host->ctx->pending_commits)) {
+    struct sl_pending_commit* pending = new sl_pending_commit();
+
+    pending->host = host;
+    pending->ticket = ticket;
+    pending->fenced = host->acquire_fence_commit;
+    pending->buffer = buffer;
+    pending->contents = host->contents_shm_mmap;
     host->contents_shm_mmap = NULL;
+    wl_list_insert(host->ctx->pending_commits.prev, &pending->link);
+    ++host->pending_commits;
+    return;
   }
+
+  sl_host_surface_commit_finish(host, buffer, host->contents_shm_mmap);
+  host->contents_shm_mmap = NULL;
 }
 
 static void sl_host_surface_set_buffer_scale(struct wl_client* client,
@@ -816,18 +1965,45 @@ static void sl_host_surface_set_buffer_scale(struct wl_client* client,
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
 
+  sl_host_surface_flush(host);
   host->contents_scale = scale;
 }
 
+static void sl_host_surface_set_opaque_region(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              struct wl_resource* region) {
+  sl_host_surface_flush(
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource)));
+  ForwardRequest<wl_surface_set_opaque_region, AllowNullResource::kYes>(
+      client, resource, region);
+}
+
+static void sl_host_surface_set_input_region(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             struct wl_resource* region) {
+  sl_host_surface_flush(
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource)));
+  ForwardRequest<wl_surface_set_input_region, AllowNullResource::kYes>(
+      client, resource, region);
+}
+
+static void sl_host_surface_set_buffer_transform(struct wl_client* client,
+                                                 struct wl_resource* resource,
+                                                 int32_t transform) {
+  sl_host_surface_flush(
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource)));
+  ForwardRequest<wl_surface_set_buffer_transform>(client, resource, transform);
+}
+
 static const struct wl_surface_interface sl_surface_implementation = {
     sl_host_surface_destroy,
     sl_host_surface_attach,
     sl_host_surface_damage,
     sl_host_surface_frame,
-    ForwardRequest<wl_surface_set_opaque_region, AllowNullResource::kYes>,
-    ForwardRequest<wl_surface_set_input_region, AllowNullResource::kYes>,
+    sl_host_surface_set_opaque_region,
+    sl_host_surface_set_input_region,
     sl_host_surface_commit,
-    ForwardRequest<wl_surface_set_buffer_transform>,
+    sl_host_surface_set_buffer_transform,
     sl_host_surface_set_buffer_scale,
     sl_host_surface_damage_buffer};
 
@@ -839,6 +2015,8 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   struct sl_window *window, *surface_window = NULL;
   struct sl_output_buffer* buffer;
 
+  sl_host_surface_flush(host);
+
   wl_list_for_each(window, &host->ctx->windows, link) {
     if (window->host_surface_id == try_wl_resource_get_id(resource)) {
       surface_window = window;
@@ -853,10 +2031,12 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
 
   if (host->contents_shm_mmap)
     sl_mmap_unref(host->contents_shm_mmap);
+  sl_host_surface_clear_acquire_fence(host);
+  wl_list_remove(&host->link);
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_pool_put(host->ctx, buffer);
   }
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
@@ -875,6 +2055,9 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   }
 
   pixman_region32_fini(&host->contents_shape);
+  pixman_region32_fini(&host->deferred_surface_damage);
+  pixman_region32_fini(&host->deferred_buffer_damage);
+  delete host->tile_hashes;
   delete host;
 }
 
@@ -996,11 +2179,42 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->scale_round_on_y = false;
   host_surface->last_event_serial = 0;
   host_surface->current_buffer = NULL;
+  host_surface->current_buffer_attached = false;
   host_surface->proxy_buffer = NULL;
   host_surface->contents_shaped = false;
+  host_surface->contents_cropped = false;
+  host_surface->viewport_cropped = false;
   pixman_region32_init(&host_surface->contents_shape);
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  host_surface->memory_bytes = 0;
+  wl_list_insert(&host_surface->ctx->host_surfaces, &host_surface->link);
+  if (host_surface->ctx->idle_trim_timeout_ms &&
+      !host_surface->ctx->idle_trim_timer) {
+    host_surface->ctx->idle_trim_timer.reset(wl_event_loop_add_timer(
+        wl_display_get_event_loop(host_surface->ctx->host_display),
+        sl_compositor_trim_idle_surfaces, host_surface->ctx));
+    wl_event_source_timer_update(host_surface->ctx->idle_trim_timer.get(),
+                                 host_surface->ctx->idle_trim_timeout_ms);
+  }
+  host_surface->damage_rects_in = 0;
+  host_surface->damage_rects_out = 0;
+  host_surface->damage_bytes_copied = 0;
+  host_surface->pending_commits = 0;
+  host_surface->buffer_queue_depth = host_surface->ctx->buffer_queue_depth;
+  host_surface->release_latency_ns = 0;
+  host_surface->commit_interval_ns = 0;
+  host_surface->last_commit_ns = 0;
+  pixman_region32_init(&host_surface->deferred_surface_damage);
+  pixman_region32_init(&host_surface->deferred_buffer_damage);
+  host_surface->tile_hashes = NULL;
+  host_surface->tile_damage_pixels_in = 0;
+  host_surface->tile_damage_pixels_out = 0;
+  host_surface->acquire_fence_fd = -1;
+  host_surface->acquire_fence_commit = false;
+  host_surface->acquire_fence_start_ns = 0;
+  host_surface->acquire_fence_wait_ns = 0;
+  host_surface->release_fence_wait_ns = 0;
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
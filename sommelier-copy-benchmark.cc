@@ -0,0 +1,245 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmark for the row copy kernels in sommelier-copy.cc.
+//
+// Copies full-frame and partial damage for common buffer layouts into a
+// shared memory mapping (standing in for the output buffer) and reports the
+// throughput of every kernel supported by this CPU next to plain memcpy().
+// Also reports how fast each hash kernel reads the same damage, which is the
+// cost --tile-hash-damage adds to every commit. Finally reports the time to
+// the first frame of a newly mapped 4K window, with and without
+// --prefault-buffers.
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define MIN_ITERATIONS 20
+#define MIN_DURATION_NS 500000000ull
+#define FIRST_FRAME_ITERATIONS 20
+
+struct sl_copy_benchmark_case {
+  const char* name;
+  size_t width;
+  size_t height;
+  size_t bpp;
+  size_t num_planes;
+  // Vertical subsampling of each plane.
+  size_t y_ss[2];
+  // Fraction of the frame that is damaged, applied to width and height.
+  double damage;
+};
+
+static const struct sl_copy_benchmark_case kCases[] = {
+    {"1080p ARGB8888 full", 1920, 1080, 4, 1, {1, 1}, 1.0},
+    {"1080p ARGB8888 1/2", 1920, 1080, 4, 1, {1, 1}, 0.5},
+    {"4K ARGB8888 full", 3840, 2160, 4, 1, {1, 1}, 1.0},
+    {"4K ARGB8888 1/2", 3840, 2160, 4, 1, {1, 1}, 0.5},
+    {"1080p NV12 full", 1920, 1080, 1, 2, {1, 2}, 1.0},
+    {"1080p NV12 1/2", 1920, 1080, 1, 2, {1, 2}, 0.5},
+    {"4K NV12 full", 3840, 2160, 1, 2, {1, 2}, 1.0},
+    {"4K NV12 1/2", 3840, 2160, 1, 2, {1, 2}, 0.5},
+};
+
+static uint64_t sl_copy_benchmark_now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static void* sl_copy_benchmark_map(size_t size) {
+  // The output buffer is a shared mapping of memory the CPU does not read
+  // back, so use a memfd rather than anonymous private memory.
+  int fd = memfd_create("sommelier-copy-benchmark", MFD_CLOEXEC);
+  void* addr;
+
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    perror("memfd");
+    exit(EXIT_FAILURE);
+  }
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  return addr;
+}
+
+static void sl_copy_benchmark_run(const struct sl_copy_benchmark_case* bench,
+                                  const struct sl_copy_kernel* kernel,
+                                  double memcpy_gbps,
+                                  double* gbps_out) {
+  // Pad strides so rows are not trivially contiguous, as with real clients.
+  size_t stride = bench->width * bench->bpp + 64;
+  size_t offset[2] = {0, stride * bench->height};
+  size_t size = offset[1] + (bench->num_planes > 1
+                                 ? stride * bench->height / bench->y_ss[1]
+                                 : 0);
+  uint8_t* src = static_cast<uint8_t*>(sl_copy_benchmark_map(size));
+  uint8_t* dst = static_cast<uint8_t*>(sl_copy_benchmark_map(size));
+  size_t x = bench->width * (1.0 - bench->damage) / 2;
+  size_t y = bench->height * (1.0 - bench->damage) / 2;
+  size_t width = bench->width * bench->damage;
+  size_t height = bench->height * bench->damage;
+  size_t bytes_per_frame = 0;
+  uint64_t iterations = 0;
+  uint64_t start, elapsed;
+
+  memset(src, 0xa5, size);
+  memset(dst, 0, size);
+
+  for (size_t i = 0; i < bench->num_planes; ++i)
+    bytes_per_frame += width * bench->bpp * (height / bench->y_ss[i]);
+
+  start = sl_copy_benchmark_now_ns();
+  do {
+    for (size_t i = 0; i < bench->num_planes; ++i) {
+      size_t plane_y = y / bench->y_ss[i];
+
+      kernel->copy_rows(dst + offset[i] + plane_y * stride + x * bench->bpp,
+                        stride,
+                        src + offset[i] + plane_y * stride + x * bench->bpp,
+                        stride, width * bench->bpp, height / bench->y_ss[i]);
+    }
+    ++iterations;
+    elapsed = sl_copy_benchmark_now_ns() - start;
+  } while (iterations < MIN_ITERATIONS || elapsed < MIN_DURATION_NS);
+
+  *gbps_out = static_cast<double>(bytes_per_frame) * iterations / elapsed;
+  printf("  %-14s %8.2f GB/s %8.1f us/frame", kernel->name, *gbps_out,
+         elapsed / 1000.0 / iterations);
+  if (memcpy_gbps > 0)
+    printf(" %6.2fx", *gbps_out / memcpy_gbps);
+  printf("\n");
+
+  munmap(src, size);
+  munmap(dst, size);
+}
+
+static void sl_copy_benchmark_hash(const struct sl_copy_benchmark_case* bench,
+                                   const struct sl_hash_kernel* kernel,
+                                   double scalar_gbps,
+                                   double* gbps_out) {
+  size_t stride = bench->width * bench->bpp + 64;
+  size_t size = stride * bench->height;
+  uint8_t* src = static_cast<uint8_t*>(sl_copy_benchmark_map(size));
+  size_t width = bench->width * bench->damage;
+  size_t height = bench->height * bench->damage;
+  uint64_t iterations = 0;
+  uint64_t start, elapsed;
+  volatile uint64_t sink = 0;
+
+  memset(src, 0xa5, size);
+
+  // Hash tile by tile, as sl_copy_reduce_damage() does. Only plane 0 is
+  // hashed; the other planes are proportionally cheaper.
+  start = sl_copy_benchmark_now_ns();
+  do {
+    for (size_t y = 0; y < height; y += SL_COPY_TILE_SIZE) {
+      for (size_t x = 0; x < width; x += SL_COPY_TILE_SIZE) {
+        size_t w = std::min<size_t>(width - x, SL_COPY_TILE_SIZE);
+        size_t h = std::min<size_t>(height - y, SL_COPY_TILE_SIZE);
+
+        sink = sink + kernel->hash_rows(src + y * stride + x * bench->bpp,
+                                        stride, w * bench->bpp, h);
+      }
+    }
+    ++iterations;
+    elapsed = sl_copy_benchmark_now_ns() - start;
+  } while (iterations < MIN_ITERATIONS || elapsed < MIN_DURATION_NS);
+
+  *gbps_out =
+      static_cast<double>(width * bench->bpp * height) * iterations / elapsed;
+  printf("  hash %-9s %8.2f GB/s %8.1f us/frame", kernel->name, *gbps_out,
+         elapsed / 1000.0 / iterations);
+  if (scalar_gbps > 0)
+    printf(" %6.2fx", *gbps_out / scalar_gbps);
+  printf("\n");
+
+  munmap(src, size);
+}
+
+// Maps a new output buffer and copies a full 4K frame into it, as for the
+// first commit of a new window. Reports the average time from mapping the
+// buffer to the end of the copy.
+static void sl_copy_benchmark_first_frame(bool prefault) {
+  const size_t width = 3840, height = 2160, bpp = 4;
+  size_t stride = width * bpp;
+  size_t size = stride * height;
+  const struct sl_copy_kernel* kernel =
+      sl_copy_kernel_for_destination(SL_COPY_DESTINATION_HOST_VISIBLE);
+  uint8_t* src = static_cast<uint8_t*>(sl_copy_benchmark_map(size));
+  uint64_t total = 0;
+
+  memset(src, 0xa5, size);
+
+  for (int i = 0; i < FIRST_FRAME_ITERATIONS; ++i) {
+    uint64_t start = sl_copy_benchmark_now_ns();
+    uint8_t* dst = static_cast<uint8_t*>(sl_copy_benchmark_map(size));
+
+    if (prefault)
+      sl_copy_prefault(dst, size);
+    kernel->copy_rows(dst, stride, src, stride, width * bpp, height);
+    total += sl_copy_benchmark_now_ns() - start;
+
+    munmap(dst, size);
+  }
+
+  printf("  %-14s %8.2f ms/frame\n", prefault ? "prefault" : "fault on copy",
+         total / 1000000.0 / FIRST_FRAME_ITERATIONS);
+
+  munmap(src, size);
+}
+
+int main() {
+  size_t num_kernels, num_hash_kernels;
+  const struct sl_copy_kernel* const* kernels =
+      sl_copy_supported_kernels(&num_kernels);
+  const struct sl_hash_kernel* const* hash_kernels =
+      sl_copy_supported_hash_kernels(&num_hash_kernels);
+
+  printf("host-visible kernel: %s\n",
+         sl_copy_kernel_for_destination(SL_COPY_DESTINATION_HOST_VISIBLE)
+             ->name);
+
+  for (const struct sl_copy_benchmark_case& bench : kCases) {
+    double memcpy_gbps = 0;
+
+    printf("%s\n", bench.name);
+    for (size_t i = 0; i < num_kernels; ++i) {
+      double gbps;
+
+      // kernels[0] is always plain memcpy() and serves as the baseline.
+      sl_copy_benchmark_run(&bench, kernels[i], memcpy_gbps, &gbps);
+      if (i == 0)
+        memcpy_gbps = gbps;
+    }
+
+    double scalar_gbps = 0;
+    for (size_t i = 0; i < num_hash_kernels; ++i) {
+      double gbps;
+
+      // hash_kernels[0] is always the scalar kernel.
+      sl_copy_benchmark_hash(&bench, hash_kernels[i], scalar_gbps, &gbps);
+      if (i == 0)
+        scalar_gbps = gbps;
+    }
+  }
+
+  printf("4K ARGB8888 first frame\n");
+  sl_copy_benchmark_first_frame(false);
+  sl_copy_benchmark_first_frame(true);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1140 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+#include "sommelier-util.h"  // NOLINT(build/include_directory)
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SL_COPY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SL_COPY_NEON 1
+#endif
+
+// How far ahead of the current source position we prefetch, in bytes. Within
+// a row the hardware prefetcher mostly keeps up, so this is deliberately
+// short; its main purpose is to warm the start of the next row, which the
+// hardware prefetcher cannot predict when the stride is larger than the row.
+#define PREFETCH_DISTANCE 512
+
+// Rows shorter than this are copied with memcpy(). Streaming stores only pay
+// off once the row covers several cache lines.
+#define STREAMING_MIN_BYTES 256
+
+#define CACHE_LINE_SIZE 64
+
+// Cost model used by sl_copy_plan(), in bytes-copied equivalents. A span
+// costs a kernel call per plane plus fixed work per row on top of the bytes
+// it copies.
+#define SPAN_OVERHEAD_BYTES 512
+#define ROW_OVERHEAD_BYTES 64
+
+// Bands handed to the copy pool are never smaller than this, so that the
+// synchronization cost stays small compared to the copy itself.
+#define MIN_BAND_BYTES (256 * 1024)
+
+// Number of previously planned spans a rectangle is tried against for
+// merging. Pixman regions are sorted into bands, so neighbours are close.
+#define MERGE_LOOKBACK 16
+
+// Mappings at least this large ask for transparent huge pages.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Added in Linux 5.14; older kernels fail it with EINVAL.
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static inline void sl_copy_prefetch_row_head(const uint8_t* src,
+                                             size_t bytes) {
+  bytes = bytes < PREFETCH_DISTANCE ? bytes : PREFETCH_DISTANCE;
+  for (size_t i = 0; i < bytes; i += CACHE_LINE_SIZE)
+    __builtin_prefetch(src + i, 0, 0);
+}
+
+static void sl_copy_rows_memcpy(uint8_t* dst,
+                                size_t dst_stride,
+                                const uint8_t* src,
+                                size_t src_stride,
+                                size_t bytes,
+                                size_t rows) {
+  // Contiguous rows can be copied in one go.
+  if (dst_stride == bytes && src_stride == bytes) {
+    memcpy(dst, src, bytes * rows);
+    return;
+  }
+
+  while (rows--) {
+    memcpy(dst, src, bytes);
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+
+static const struct sl_copy_kernel sl_copy_kernel_memcpy = {
+    "memcpy", sl_copy_rows_memcpy, false};
+
+#if defined(SL_COPY_X86)
+
+// SSE2 is only implied on x86_64. On i386 the kernel is compiled for it
+// explicitly, and only picked when the CPU has it.
+__attribute__((target("sse2"))) static void sl_copy_rows_sse2_stream(
+    uint8_t* dst,
+    size_t dst_stride,
+    const uint8_t* src,
+    size_t src_stride,
+    size_t bytes,
+    size_t rows) {
+  if (bytes < STREAMING_MIN_BYTES) {
+    sl_copy_rows_memcpy(dst, dst_stride, src, src_stride, bytes, rows);
+    return;
+  }
+
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15;
+
+    if (rows)
+      sl_copy_prefetch_row_head(src + src_stride, bytes);
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 64) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+      __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+      __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+      _mm_stream_si128(reinterpret_cast<__m128i*>(d), a);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), b);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), c);
+      _mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), e);
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    while (n >= 16) {
+      _mm_stream_si128(reinterpret_cast<__m128i*>(d),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)));
+      d += 16;
+      s += 16;
+      n -= 16;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+  // Make the streaming stores visible before the host is told to read.
+  _mm_sfence();
+}
+
+static const struct sl_copy_kernel sl_copy_kernel_sse2 = {
+    "sse2-stream", sl_copy_rows_sse2_stream, true};
+
+__attribute__((target("avx2"))) static void sl_copy_rows_avx2_stream(
+    uint8_t* dst,
+    size_t dst_stride,
+    const uint8_t* src,
+    size_t src_stride,
+    size_t bytes,
+    size_t rows) {
+  if (bytes < STREAMING_MIN_BYTES) {
+    sl_copy_rows_memcpy(dst, dst_stride, src, src_stride, bytes, rows);
+    return;
+  }
+
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = (32 - (reinterpret_cast<uintptr_t>(d) & 31)) & 31;
+
+    if (rows)
+      sl_copy_prefetch_row_head(src + src_stride, bytes);
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 128) {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+      __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+      __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+      _mm256_stream_si256(reinterpret_cast<__m256i*>(d), a);
+      _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 32), b);
+      _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 64), c);
+      _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 96), e);
+      d += 128;
+      s += 128;
+      n -= 128;
+    }
+    while (n >= 32) {
+      _mm256_stream_si256(
+          reinterpret_cast<__m256i*>(d),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s)));
+      d += 32;
+      s += 32;
+      n -= 32;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+  _mm_sfence();
+}
+
+static const struct sl_copy_kernel sl_copy_kernel_avx2 = {
+    "avx2-stream", sl_copy_rows_avx2_stream, true};
+
+__attribute__((target("avx512f"))) static void sl_copy_rows_avx512_stream(
+    uint8_t* dst,
+    size_t dst_stride,
+    const uint8_t* src,
+    size_t src_stride,
+    size_t bytes,
+    size_t rows) {
+  if (bytes < STREAMING_MIN_BYTES) {
+    sl_copy_rows_memcpy(dst, dst_stride, src, src_stride, bytes, rows);
+    return;
+  }
+
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = (64 - (reinterpret_cast<uintptr_t>(d) & 63)) & 63;
+
+    if (rows)
+      sl_copy_prefetch_row_head(src + src_stride, bytes);
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    while (n >= 256) {
+      __m512i a = _mm512_loadu_si512(s);
+      __m512i b = _mm512_loadu_si512(s + 64);
+      __m512i c = _mm512_loadu_si512(s + 128);
+      __m512i e = _mm512_loadu_si512(s + 192);
+      _mm512_stream_si512(reinterpret_cast<__m512i*>(d), a);
+      _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 64), b);
+      _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 128), c);
+      _mm512_stream_si512(reinterpret_cast<__m512i*>(d + 192), e);
+      d += 256;
+      s += 256;
+      n -= 256;
+    }
+    while (n >= 64) {
+      _mm512_stream_si512(reinterpret_cast<__m512i*>(d), _mm512_loadu_si512(s));
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+  _mm_sfence();
+}
+
+static const struct sl_copy_kernel sl_copy_kernel_avx512 = {
+    "avx512-stream", sl_copy_rows_avx512_stream, true};
+
+#elif defined(SL_COPY_NEON)
+
+static void sl_copy_rows_neon_stream(uint8_t* dst,
+                                     size_t dst_stride,
+                                     const uint8_t* src,
+                                     size_t src_stride,
+                                     size_t bytes,
+                                     size_t rows) {
+  if (bytes < STREAMING_MIN_BYTES) {
+    sl_copy_rows_memcpy(dst, dst_stride, src, src_stride, bytes, rows);
+    return;
+  }
+
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+
+    if (rows)
+      sl_copy_prefetch_row_head(src + src_stride, bytes);
+
+    while (n >= 64) {
+      uint8x16_t a = vld1q_u8(s);
+      uint8x16_t b = vld1q_u8(s + 16);
+      uint8x16_t c = vld1q_u8(s + 32);
+      uint8x16_t e = vld1q_u8(s + 48);
+      // STNP is the AArch64 non-temporal store; there is no intrinsic for it.
+      asm volatile("stnp %q[a], %q[b], [%[d]]\n\t"
+                   "stnp %q[c], %q[e], [%[d], #32]"
+                   :
+                   : [a] "w"(a), [b] "w"(b), [c] "w"(c), [e] "w"(e), [d] "r"(d)
+                   : "memory");
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    while (n >= 16) {
+      vst1q_u8(d, vld1q_u8(s));
+      d += 16;
+      s += 16;
+      n -= 16;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+
+  // Order the non-temporal stores before any later notification of the host.
+  asm volatile("dmb ishst" : : : "memory");
+}
+
+static const struct sl_copy_kernel sl_copy_kernel_neon = {
+    "neon-stream", sl_copy_rows_neon_stream, true};
+
+#endif
+
+namespace {
+
+struct sl_copy_kernel_table {
+  const struct sl_copy_kernel* supported[4];
+  size_t num_supported;
+  const struct sl_copy_kernel* streaming;
+};
+
+sl_copy_kernel_table sl_copy_probe_kernels() {
+  sl_copy_kernel_table table = {};
+
+  table.supported[table.num_supported++] = &sl_copy_kernel_memcpy;
+  table.streaming = &sl_copy_kernel_memcpy;
+#if defined(SL_COPY_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    table.supported[table.num_supported++] = &sl_copy_kernel_sse2;
+    table.streaming = &sl_copy_kernel_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    table.supported[table.num_supported++] = &sl_copy_kernel_avx2;
+    table.streaming = &sl_copy_kernel_avx2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    table.supported[table.num_supported++] = &sl_copy_kernel_avx512;
+    table.streaming = &sl_copy_kernel_avx512;
+  }
+#elif defined(SL_COPY_NEON)
+  // Advanced SIMD is mandatory on AArch64.
+  table.supported[table.num_supported++] = &sl_copy_kernel_neon;
+  table.streaming = &sl_copy_kernel_neon;
+#endif
+
+  return table;
+}
+
+const sl_copy_kernel_table& sl_copy_kernels() {
+  static const sl_copy_kernel_table table = sl_copy_probe_kernels();
+  return table;
+}
+
+}  // namespace
+
+const struct sl_copy_kernel* sl_copy_kernel_for_destination(
+    slCopyDestination destination) {
+  switch (destination) {
+    case SL_COPY_DESTINATION_HOST_VISIBLE:
+      return sl_copy_kernels().streaming;
+    case SL_COPY_DESTINATION_CACHED:
+    default:
+      // glibc's memcpy() is already the best choice when the result should
+      // stay in the cache.
+      return &sl_copy_kernel_memcpy;
+  }
+}
+
+const struct sl_copy_kernel* const* sl_copy_supported_kernels(size_t* count) {
+  const sl_copy_kernel_table& table = sl_copy_kernels();
+
+  *count = table.num_supported;
+  return table.supported;
+}
+
+// Row hashing. Every 16-byte chunk is split into two 64-bit lanes; each lane
+// is mixed with a key that changes with its position, so that moving content
+// around changes the hash, and summed into a per-lane accumulator. Sums are
+// order independent, so the scalar and vector versions below produce the
+// same hash however many chunks they process at once.
+#define HASH_KEY0 0x9e3779b97f4a7c15ull
+#define HASH_KEY1 0xc2b2ae3d27d4eb4full
+#define HASH_KEY_STEP 0x165667b19e3779f9ull
+#define HASH_ROW_SALT 0x27d4eb2f165667c5ull
+
+static inline void sl_hash_chunk_scalar(const uint8_t* src,
+                                        uint64_t key[2],
+                                        uint64_t acc[2]) {
+  for (size_t i = 0; i < 2; ++i) {
+    uint64_t d, x;
+
+    memcpy(&d, src + i * 8, 8);
+    x = d ^ key[i];
+    acc[i] += d + (x & 0xffffffff) * (x >> 32);
+    key[i] += HASH_KEY_STEP;
+  }
+}
+
+// Hashes the last `n` (< 16) bytes of a row as a zero-padded chunk.
+static inline void sl_hash_tail(const uint8_t* src,
+                                size_t n,
+                                uint64_t key[2],
+                                uint64_t acc[2]) {
+  uint8_t chunk[16] = {0};
+
+  if (!n)
+    return;
+  memcpy(chunk, src, n);
+  sl_hash_chunk_scalar(chunk, key, acc);
+}
+
+static uint64_t sl_hash_finish(uint64_t h, size_t bytes, size_t rows) {
+  h ^= bytes * HASH_KEY0 + rows;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  // Never 0, which sl_copy_tile_hashes uses for unknown tiles.
+  return h | 1;
+}
+
+static uint64_t sl_hash_rows_scalar(const uint8_t* src,
+                                    size_t stride,
+                                    size_t bytes,
+                                    size_t rows) {
+  uint64_t acc[2] = {0, 0};
+
+  for (size_t r = 0; r < rows; ++r) {
+    const uint8_t* s = src + r * stride;
+    uint64_t key[2] = {HASH_KEY0 ^ (r * HASH_ROW_SALT),
+                       HASH_KEY1 ^ (r * HASH_ROW_SALT)};
+    size_t n = bytes;
+
+    for (; n >= 16; n -= 16, s += 16)
+      sl_hash_chunk_scalar(s, key, acc);
+    sl_hash_tail(s, n, key, acc);
+  }
+
+  return sl_hash_finish(acc[0] + acc[1], bytes, rows);
+}
+
+static const struct sl_hash_kernel sl_hash_kernel_scalar = {
+    "scalar", sl_hash_rows_scalar};
+
+#if defined(SL_COPY_X86)
+
+__attribute__((target("sse2"))) static uint64_t sl_hash_rows_sse2(
+    const uint8_t* src,
+    size_t stride,
+    size_t bytes,
+    size_t rows) {
+  const __m128i step = _mm_set1_epi64x(HASH_KEY_STEP);
+  __m128i acc = _mm_setzero_si128();
+  uint64_t tail_acc[2] = {0, 0};
+  uint64_t lanes[2];
+
+  for (size_t r = 0; r < rows; ++r) {
+    const uint8_t* s = src + r * stride;
+    uint64_t salt = r * HASH_ROW_SALT;
+    __m128i key = _mm_set_epi64x(HASH_KEY1 ^ salt, HASH_KEY0 ^ salt);
+    size_t n = bytes;
+
+    for (; n >= 16; n -= 16, s += 16) {
+      __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+      __m128i x = _mm_xor_si128(d, key);
+
+      acc = _mm_add_epi64(
+          acc, _mm_add_epi64(d, _mm_mul_epu32(x, _mm_srli_epi64(x, 32))));
+      key = _mm_add_epi64(key, step);
+    }
+    if (n) {
+      uint64_t k[2];
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(k), key);
+      sl_hash_tail(s, n, k, tail_acc);
+    }
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+  return sl_hash_finish(lanes[0] + lanes[1] + tail_acc[0] + tail_acc[1],
+                        bytes, rows);
+}
+
+static const struct sl_hash_kernel sl_hash_kernel_sse2 = {"sse2",
+                                                          sl_hash_rows_sse2};
+
+__attribute__((target("avx2"))) static uint64_t sl_hash_rows_avx2(
+    const uint8_t* src,
+    size_t stride,
+    size_t bytes,
+    size_t rows) {
+  const __m256i step = _mm256_set1_epi64x(2 * HASH_KEY_STEP);
+  __m256i acc = _mm256_setzero_si256();
+  uint64_t tail_acc[2] = {0, 0};
+  uint64_t lanes[4];
+
+  for (size_t r = 0; r < rows; ++r) {
+    const uint8_t* s = src + r * stride;
+    uint64_t salt = r * HASH_ROW_SALT;
+    // Two consecutive chunks per iteration.
+    __m256i key = _mm256_set_epi64x(
+        (HASH_KEY1 ^ salt) + HASH_KEY_STEP, (HASH_KEY0 ^ salt) + HASH_KEY_STEP,
+        HASH_KEY1 ^ salt, HASH_KEY0 ^ salt);
+    size_t n = bytes;
+
+    for (; n >= 32; n -= 32, s += 32) {
+      __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+      __m256i x = _mm256_xor_si256(d, key);
+
+      acc = _mm256_add_epi64(
+          acc,
+          _mm256_add_epi64(d, _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32))));
+      key = _mm256_add_epi64(key, step);
+    }
+    if (n) {
+      uint64_t k[4];
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(k), key);
+      if (n >= 16) {
+        sl_hash_chunk_scalar(s, k, tail_acc);
+        s += 16;
+        n -= 16;
+      }
+      sl_hash_tail(s, n, k, tail_acc);
+    }
+  }
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  return sl_hash_finish(
+      lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail_acc[0] + tail_acc[1],
+      bytes, rows);
+}
+
+static const struct sl_hash_kernel sl_hash_kernel_avx2 = {"avx2",
+                                                          sl_hash_rows_avx2};
+
+#elif defined(SL_COPY_NEON)
+
+static uint64_t sl_hash_rows_neon(const uint8_t* src,
+                                  size_t stride,
+                                  size_t bytes,
+                                  size_t rows) {
+  const uint64x2_t step = vdupq_n_u64(HASH_KEY_STEP);
+  uint64x2_t acc = vdupq_n_u64(0);
+  uint64_t tail_acc[2] = {0, 0};
+
+  for (size_t r = 0; r < rows; ++r) {
+    const uint8_t* s = src + r * stride;
+    uint64_t salt = r * HASH_ROW_SALT;
+    uint64_t k[2] = {HASH_KEY0 ^ salt, HASH_KEY1 ^ salt};
+    uint64x2_t key = vld1q_u64(k);
+    size_t n = bytes;
+
+    for (; n >= 16; n -= 16, s += 16) {
+      uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(s));
+      uint64x2_t x = veorq_u64(d, key);
+
+      acc = vaddq_u64(
+          acc, vaddq_u64(d, vmull_u32(vmovn_u64(x), vshrn_n_u64(x, 32))));
+      key = vaddq_u64(key, step);
+    }
+    if (n) {
+      vst1q_u64(k, key);
+      sl_hash_tail(s, n, k, tail_acc);
+    }
+  }
+
+  return sl_hash_finish(vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) +
+                            tail_acc[0] + tail_acc[1],
+                        bytes, rows);
+}
+
+static const struct sl_hash_kernel sl_hash_kernel_neon = {"neon",
+                                                          sl_hash_rows_neon};
+
+#endif
+
+namespace {
+
+struct sl_hash_kernel_table {
+  const struct sl_hash_kernel* supported[3];
+  size_t num_supported;
+};
+
+sl_hash_kernel_table sl_hash_probe_kernels() {
+  sl_hash_kernel_table table = {};
+
+  table.supported[table.num_supported++] = &sl_hash_kernel_scalar;
+#if defined(SL_COPY_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    table.supported[table.num_supported++] = &sl_hash_kernel_sse2;
+  if (__builtin_cpu_supports("avx2"))
+    table.supported[table.num_supported++] = &sl_hash_kernel_avx2;
+#elif defined(SL_COPY_NEON)
+  table.supported[table.num_supported++] = &sl_hash_kernel_neon;
+#endif
+
+  return table;
+}
+
+const sl_hash_kernel_table& sl_hash_kernels() {
+  static const sl_hash_kernel_table table = sl_hash_probe_kernels();
+  return table;
+}
+
+}  // namespace
+
+const struct sl_hash_kernel* sl_copy_hash_kernel() {
+  const sl_hash_kernel_table& table = sl_hash_kernels();
+
+  return table.supported[table.num_supported - 1];
+}
+
+const struct sl_hash_kernel* const* sl_copy_supported_hash_kernels(
+    size_t* count) {
+  const sl_hash_kernel_table& table = sl_hash_kernels();
+
+  *count = table.num_supported;
+  return table.supported;
+}
+
+static size_t sl_copy_span_cost(const struct sl_copy_job* job,
+                                const struct sl_copy_span* span) {
+  size_t cost = SPAN_OVERHEAD_BYTES;
+
+  for (size_t i = 0; i < job->num_planes; ++i) {
+    size_t rows = (span->y + span->height) / job->y_ss[i] -
+                  span->y / job->y_ss[i];
+
+    if (span->contiguous)
+      cost += rows * job->dst_stride[i];
+    else
+      cost += rows * (ROW_OVERHEAD_BYTES + span->width * job->bpp);
+  }
+  return cost;
+}
+
+// Widens `span` to whole rows if the block copy that allows is cheaper.
+static void sl_copy_span_try_contiguous(const struct sl_copy_job* job,
+                                        struct sl_copy_span* span) {
+  struct sl_copy_span full = {0, span->y, job->width, span->height, true};
+
+  for (size_t i = 0; i < job->num_planes; ++i) {
+    if (job->src_stride[i] != job->dst_stride[i])
+      return;
+  }
+  if (sl_copy_span_cost(job, &full) <= sl_copy_span_cost(job, span))
+    *span = full;
+}
+
+void sl_copy_plan(const struct sl_copy_job* job,
+                  pixman_region32_t* damage,
+                  std::vector<struct sl_copy_span>* spans) {
+  pixman_region32_t clipped;
+  pixman_box32_t* rect;
+  int n;
+
+  spans->clear();
+
+  pixman_region32_init(&clipped);
+  pixman_region32_intersect_rect(&clipped, damage, 0, 0, job->width,
+                                 job->height);
+
+  rect = pixman_region32_rectangles(&clipped, &n);
+  while (n--) {
+    struct sl_copy_span span = {rect->x1, rect->y1, rect->x2 - rect->x1,
+                                rect->y2 - rect->y1, false};
+    size_t span_cost;
+    size_t j;
+    bool merged = false;
+
+    ++rect;
+    sl_copy_span_try_contiguous(job, &span);
+    span_cost = sl_copy_span_cost(job, &span);
+
+    for (j = spans->size(); j > 0 && j + MERGE_LOOKBACK > spans->size(); --j) {
+      struct sl_copy_span* other = &(*spans)[j - 1];
+      int32_t x1 = std::min(other->x, span.x);
+      int32_t y1 = std::min(other->y, span.y);
+      int32_t x2 = std::max(other->x + other->width, span.x + span.width);
+      int32_t y2 = std::max(other->y + other->height, span.y + span.height);
+      struct sl_copy_span bounds = {x1, y1, x2 - x1, y2 - y1,
+                                    other->contiguous && span.contiguous};
+
+      sl_copy_span_try_contiguous(job, &bounds);
+      if (sl_copy_span_cost(job, &bounds) <=
+          sl_copy_span_cost(job, other) + span_cost) {
+        *other = bounds;
+        merged = true;
+        break;
+      }
+    }
+
+    if (!merged)
+      spans->push_back(span);
+  }
+
+  pixman_region32_fini(&clipped);
+}
+
+size_t sl_copy_span_execute(const struct sl_copy_job* job,
+                            const struct sl_copy_span* span) {
+  size_t copied = 0;
+
+  for (size_t i = 0; i < job->num_planes; ++i) {
+    size_t y1 = span->y / job->y_ss[i];
+    size_t rows = (span->y + span->height) / job->y_ss[i] - y1;
+    size_t bytes = span->width * job->bpp;
+    uint8_t* src = job->src_addr + job->src_offset[i] +
+                   y1 * job->src_stride[i] + span->x * job->bpp;
+    uint8_t* dst = job->dst_addr + job->dst_offset[i] +
+                   y1 * job->dst_stride[i] + span->x * job->bpp;
+
+    if (!rows)
+      continue;
+
+    if (span->contiguous) {
+      // Stop at the end of the last row's pixels, its padding may be past the
+      // end of the mapping.
+      size_t block = (rows - 1) * job->dst_stride[i] + bytes;
+
+      job->kernel->copy_rows(dst, block, src, block, block, 1);
+      copied += block;
+    } else {
+      job->kernel->copy_rows(dst, job->dst_stride[i], src, job->src_stride[i],
+                             bytes, rows);
+      copied += bytes * rows;
+    }
+  }
+
+  return copied;
+}
+
+void sl_copy_tile_hashes_reset(struct sl_copy_tile_hashes* tiles,
+                               int32_t width,
+                               int32_t height) {
+  size_t cols = (width + SL_COPY_TILE_SIZE - 1) / SL_COPY_TILE_SIZE;
+  size_t rows = (height + SL_COPY_TILE_SIZE - 1) / SL_COPY_TILE_SIZE;
+
+  if (tiles->width == width && tiles->height == height)
+    return;
+
+  tiles->width = width;
+  tiles->height = height;
+  tiles->hashes.assign(cols * rows, 0);
+}
+
+static uint64_t sl_copy_hash_tile(const struct sl_copy_job* job,
+                                  const struct sl_hash_kernel* kernel,
+                                  const pixman_box32_t* box) {
+  uint64_t hash = 0;
+
+  for (size_t i = 0; i < job->num_planes; ++i) {
+    size_t y1 = box->y1 / job->y_ss[i];
+    size_t rows = box->y2 / job->y_ss[i] - y1;
+
+    if (!rows)
+      continue;
+    hash = hash * HASH_KEY1 +
+           kernel->hash_rows(job->src_addr + job->src_offset[i] +
+                                 y1 * job->src_stride[i] + box->x1 * job->bpp,
+                             job->src_stride[i], (box->x2 - box->x1) * job->bpp,
+                             rows);
+  }
+
+  return hash | 1;
+}
+
+void sl_copy_reduce_damage(const struct sl_copy_job* job,
+                           const struct sl_hash_kernel* kernel,
+                           pixman_region32_t* copy_damage,
+                           struct sl_copy_tile_hashes* copy_tiles,
+                           pixman_region32_t* host_damage,
+                           struct sl_copy_tile_hashes* host_tiles) {
+  size_t cols = (job->width + SL_COPY_TILE_SIZE - 1) / SL_COPY_TILE_SIZE;
+  pixman_region32_t tiles, copy_changed, host_changed;
+  pixman_box32_t* rects;
+  int n;
+
+  sl_copy_tile_hashes_reset(copy_tiles, job->width, job->height);
+  sl_copy_tile_hashes_reset(host_tiles, job->width, job->height);
+
+  // Round the damage out to whole tiles. The resulting region is made of
+  // disjoint tile-aligned rectangles, so every tile is visited once below.
+  pixman_region32_init(&tiles);
+  pixman_region32_union(&tiles, copy_damage, host_damage);
+  rects = pixman_region32_rectangles(&tiles, &n);
+  {
+    pixman_region32_t aligned;
+
+    pixman_region32_init(&aligned);
+    for (int i = 0; i < n; ++i) {
+      int32_t x1 = rects[i].x1 / SL_COPY_TILE_SIZE * SL_COPY_TILE_SIZE;
+      int32_t y1 = rects[i].y1 / SL_COPY_TILE_SIZE * SL_COPY_TILE_SIZE;
+      int32_t x2 = (rects[i].x2 + SL_COPY_TILE_SIZE - 1) / SL_COPY_TILE_SIZE *
+                   SL_COPY_TILE_SIZE;
+      int32_t y2 = (rects[i].y2 + SL_COPY_TILE_SIZE - 1) / SL_COPY_TILE_SIZE *
+                   SL_COPY_TILE_SIZE;
+
+      pixman_region32_union_rect(&aligned, &aligned, x1, y1, x2 - x1, y2 - y1);
+    }
+    pixman_region32_intersect_rect(&tiles, &aligned, 0, 0, job->width,
+                                   job->height);
+    pixman_region32_fini(&aligned);
+  }
+
+  pixman_region32_init(&copy_changed);
+  pixman_region32_init(&host_changed);
+  rects = pixman_region32_rectangles(&tiles, &n);
+  for (int i = 0; i < n; ++i) {
+    for (int32_t y = rects[i].y1; y < rects[i].y2; y += SL_COPY_TILE_SIZE) {
+      for (int32_t x = rects[i].x1; x < rects[i].x2; x += SL_COPY_TILE_SIZE) {
+        pixman_box32_t box = {x, y,
+                              std::min(x + SL_COPY_TILE_SIZE, rects[i].x2),
+                              std::min(y + SL_COPY_TILE_SIZE, rects[i].y2)};
+        size_t index = (y / SL_COPY_TILE_SIZE) * cols + x / SL_COPY_TILE_SIZE;
+        uint64_t hash = sl_copy_hash_tile(job, kernel, &box);
+
+        // Changed tiles are copied whole, so that the destination tile
+        // matches the hash recorded for it afterwards. Tiles outside the copy
+        // damage already match the source.
+        if (copy_tiles->hashes[index] != hash &&
+            pixman_region32_contains_rectangle(copy_damage, &box) !=
+                PIXMAN_REGION_OUT) {
+          pixman_region32_union_rect(&copy_changed, &copy_changed, box.x1,
+                                     box.y1, box.x2 - box.x1, box.y2 - box.y1);
+        }
+        if (host_tiles->hashes[index] != hash) {
+          pixman_region32_union_rect(&host_changed, &host_changed, box.x1,
+                                     box.y1, box.x2 - box.x1, box.y2 - box.y1);
+        }
+        copy_tiles->hashes[index] = hash;
+        host_tiles->hashes[index] = hash;
+      }
+    }
+  }
+
+  pixman_region32_copy(copy_damage, &copy_changed);
+  pixman_region32_intersect(host_damage, host_damage, &host_changed);
+
+  pixman_region32_fini(&host_changed);
+  pixman_region32_fini(&copy_changed);
+  pixman_region32_fini(&tiles);
+}
+
+bool sl_copy_prefault(void* addr, size_t size) {
+  // Only a hint; memory the channel allocated for the host, e.g. most
+  // dma-bufs, cannot be backed by huge pages and fails it.
+  if (size >= HUGE_PAGE_SIZE)
+    madvise(addr, size, MADV_HUGEPAGE);
+
+  return !madvise(addr, size, MADV_POPULATE_WRITE);
+}
+
+struct sl_copy_pool {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+  bool quit = false;
+  // Incremented every time a new set of bands is published.
+  uint64_t generation = 0;
+  // The fields below describe the current copy and are only changed by the
+  // thread calling sl_copy_pool_run() while holding `mutex`.
+  const struct sl_copy_job* job = nullptr;
+  std::vector<struct sl_copy_span> bands;
+  size_t next_band = 0;
+  size_t bands_done = 0;
+  size_t bytes_copied = 0;
+  // Number of workers currently copying bands.
+  int active = 0;
+};
+
+static size_t sl_copy_span_bytes(const struct sl_copy_job* job,
+                                 const struct sl_copy_span* span) {
+  size_t bytes = 0;
+
+  for (size_t i = 0; i < job->num_planes; ++i) {
+    size_t rows = (span->y + span->height) / job->y_ss[i] -
+                  span->y / job->y_ss[i];
+
+    bytes += rows * span->width * job->bpp;
+  }
+  return bytes;
+}
+
+size_t sl_copy_plan_bytes(const struct sl_copy_job* job,
+                          const std::vector<struct sl_copy_span>& spans) {
+  size_t bytes = 0;
+
+  for (const struct sl_copy_span& span : spans)
+    bytes += sl_copy_span_bytes(job, &span);
+  return bytes;
+}
+
+// Copies bands until none are left. Called with `lock` held; the lock is
+// dropped while copying.
+static void sl_copy_pool_work(struct sl_copy_pool* pool,
+                              std::unique_lock<std::mutex>& lock) {
+  while (pool->next_band < pool->bands.size()) {
+    const struct sl_copy_span* band = &pool->bands[pool->next_band++];
+    size_t bytes;
+
+    lock.unlock();
+    bytes = sl_copy_span_execute(pool->job, band);
+    lock.lock();
+
+    pool->bytes_copied += bytes;
+    if (++pool->bands_done == pool->bands.size())
+      pool->done_cv.notify_one();
+  }
+}
+
+static void sl_copy_pool_thread(struct sl_copy_pool* pool) {
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  uint64_t generation = pool->generation;
+
+  while (true) {
+    pool->work_cv.wait(
+        lock, [&] { return pool->quit || pool->generation != generation; });
+    if (pool->quit)
+      break;
+    generation = pool->generation;
+
+    ++pool->active;
+    sl_copy_pool_work(pool, lock);
+    if (--pool->active == 0)
+      pool->done_cv.notify_one();
+  }
+}
+
+struct sl_copy_pool* sl_copy_pool_create(int num_threads) {
+  struct sl_copy_pool* pool = new sl_copy_pool();
+
+  for (int i = 0; i < num_threads; ++i)
+    pool->threads.emplace_back(sl_copy_pool_thread, pool);
+  return pool;
+}
+
+void sl_copy_pool_destroy(struct sl_copy_pool* pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->quit = true;
+  }
+  pool->work_cv.notify_all();
+  for (std::thread& thread : pool->threads)
+    thread.join();
+  delete pool;
+}
+
+size_t sl_copy_pool_run(struct sl_copy_pool* pool,
+                        const struct sl_copy_job* job,
+                        const std::vector<struct sl_copy_span>& spans,
+                        size_t threshold) {
+  size_t total = sl_copy_plan_bytes(job, spans);
+  size_t bytes_copied = 0;
+
+  if (!pool || pool->threads.empty() || total < threshold) {
+    for (const struct sl_copy_span& span : spans)
+      bytes_copied += sl_copy_span_execute(job, &span);
+    return bytes_copied;
+  }
+
+  std::unique_lock<std::mutex> lock(pool->mutex);
+
+  // Aim for two bands per thread so that a slow thread does not hold up the
+  // others for long.
+  size_t band_bytes = std::max<size_t>(
+      total / ((pool->threads.size() + 1) * 2), MIN_BAND_BYTES);
+
+  pool->bands.clear();
+  for (const struct sl_copy_span& span : spans) {
+    size_t num_bands = std::min<size_t>(
+        (sl_copy_span_bytes(job, &span) + band_bytes - 1) / band_bytes,
+        span.height);
+    int32_t rows_per_band = (span.height + num_bands - 1) / num_bands;
+
+    // Band boundaries do not need to be aligned to the vertical subsampling;
+    // sl_copy_span_execute() rounds every band's plane rows down, so
+    // adjacent bands cover each subsampled row exactly once.
+    for (int32_t y = 0; y < span.height; y += rows_per_band) {
+      struct sl_copy_span band = span;
+
+      band.y = span.y + y;
+      band.height = std::min(rows_per_band, span.height - y);
+      pool->bands.push_back(band);
+    }
+  }
+  pool->job = job;
+  pool->next_band = 0;
+  pool->bands_done = 0;
+  pool->bytes_copied = 0;
+  ++pool->generation;
+  pool->work_cv.notify_all();
+
+  // Help out instead of sitting idle, then wait for the stragglers. Workers
+  // must also have left sl_copy_pool_work() before the bands can be reused.
+  sl_copy_pool_work(pool, lock);
+  pool->done_cv.wait(lock, [&] {
+    return pool->bands_done == pool->bands.size() && pool->active == 0;
+  });
+
+  bytes_copied = pool->bytes_copied;
+  pool->job = nullptr;
+  return bytes_copied;
+}
+
+struct sl_copy_queue_entry {
+  uint64_t ticket;
+  struct sl_copy_job job;
+  std::vector<struct sl_copy_span> spans;
+  size_t bytes_copied;
+};
+
+struct sl_copy_queue {
+  struct sl_copy_pool* pool;
+  size_t threshold;
+  int event_fd;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable submit_cv;
+  std::condition_variable complete_cv;
+  bool quit = false;
+  uint64_t last_ticket = 0;
+  uint64_t completed_ticket = 0;
+  // Copies waiting for the thread, and finished copies waiting to be
+  // retrieved with sl_copy_queue_poll().
+  std::deque<struct sl_copy_queue_entry> pending;
+  std::deque<struct sl_copy_queue_entry> completed;
+};
+
+static void sl_copy_queue_thread(struct sl_copy_queue* queue) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  while (true) {
+    queue->submit_cv.wait(
+        lock, [&] { return queue->quit || !queue->pending.empty(); });
+    if (queue->pending.empty())
+      break;
+
+    struct sl_copy_queue_entry entry = std::move(queue->pending.front());
+    queue->pending.pop_front();
+
+    lock.unlock();
+    entry.bytes_copied = sl_copy_pool_run(queue->pool, &entry.job,
+                                          entry.spans, queue->threshold);
+    lock.lock();
+
+    queue->completed_ticket = entry.ticket;
+    queue->completed.push_back(std::move(entry));
+    queue->complete_cv.notify_all();
+
+    uint64_t value = 1;
+    ssize_t rv = write(queue->event_fd, &value, sizeof(value));
+    UNUSED(rv);
+  }
+}
+
+struct sl_copy_queue* sl_copy_queue_create(struct sl_copy_pool* pool,
+                                           size_t threshold) {
+  struct sl_copy_queue* queue = new sl_copy_queue();
+
+  queue->pool = pool;
+  queue->threshold = threshold;
+  queue->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  errno_assert(queue->event_fd >= 0);
+  queue->thread = std::thread(sl_copy_queue_thread, queue);
+  return queue;
+}
+
+void sl_copy_queue_destroy(struct sl_copy_queue* queue) {
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->quit = true;
+  }
+  queue->submit_cv.notify_one();
+  queue->thread.join();
+  close(queue->event_fd);
+  delete queue;
+}
+
+int sl_copy_queue_fd(struct sl_copy_queue* queue) {
+  return queue->event_fd;
+}
+
+uint64_t sl_copy_queue_submit(struct sl_copy_queue* queue,
+                              const struct sl_copy_job* job,
+                              std::vector<struct sl_copy_span> spans) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  struct sl_copy_queue_entry entry;
+
+  entry.ticket = ++queue->last_ticket;
+  entry.job = *job;
+  entry.spans = std::move(spans);
+  entry.bytes_copied = 0;
+  queue->pending.push_back(std::move(entry));
+  queue->submit_cv.notify_one();
+  return queue->last_ticket;
+}
+
+bool sl_copy_queue_poll(struct sl_copy_queue* queue,
+                        uint64_t* ticket,
+                        size_t* bytes_copied) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  uint64_t value;
+
+  // Reset the eventfd. Anything completed afterwards writes to it again.
+  ssize_t rv = read(queue->event_fd, &value, sizeof(value));
+  UNUSED(rv);
+
+  if (queue->completed.empty())
+    return false;
+
+  *ticket = queue->completed.front().ticket;
+  *bytes_copied = queue->completed.front().bytes_copied;
+  queue->completed.pop_front();
+  return true;
+}
+
+void sl_copy_queue_wait(struct sl_copy_queue* queue, uint64_t ticket) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+
+  queue->complete_cv.wait(lock,
+                          [&] { return queue->completed_ticket >= ticket; });
+}
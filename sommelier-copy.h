@@ -0,0 +1,204 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_COPY_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_COPY_H_
+
+#include <pixman.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Copies `rows` rows of `bytes` bytes each from `src` to `dst`, advancing by
+// the respective stride after every row.
+typedef void (*sl_copy_rows_func_t)(uint8_t* dst,
+                                    size_t dst_stride,
+                                    const uint8_t* src,
+                                    size_t src_stride,
+                                    size_t bytes,
+                                    size_t rows);
+
+enum slCopyDestination {
+  // Memory that the CPU is expected to read again soon (e.g. a wl_shm
+  // buffer the host compositor uploads with the CPU). Regular stores are
+  // used so the data stays in the cache hierarchy.
+  SL_COPY_DESTINATION_CACHED,
+  // Memory that is handed to the host GPU (e.g. a dma-buf allocated through
+  // the Wayland channel). The CPU never reads it back, so streaming
+  // (non-temporal) stores are used where the CPU supports them.
+  SL_COPY_DESTINATION_HOST_VISIBLE
+};
+
+struct sl_copy_kernel {
+  const char* name;
+  sl_copy_rows_func_t copy_rows;
+  // True if the kernel bypasses the cache when writing the destination.
+  bool streaming;
+};
+
+// Returns the kernel to use for copies into memory of type `destination`. The
+// choice is made once, on first use, based on the features of the CPU we are
+// running on.
+const struct sl_copy_kernel* sl_copy_kernel_for_destination(
+    slCopyDestination destination);
+
+// Returns every kernel supported by the running CPU, starting with the plain
+// memcpy() kernel. Exported for testing and benchmarking.
+const struct sl_copy_kernel* const* sl_copy_supported_kernels(size_t* count);
+
+// Returns a hash of `rows` rows of `bytes` bytes each, starting at `src` and
+// advancing by `stride` after every row. The result is never 0.
+typedef uint64_t (*sl_hash_rows_func_t)(const uint8_t* src,
+                                        size_t stride,
+                                        size_t bytes,
+                                        size_t rows);
+
+struct sl_hash_kernel {
+  const char* name;
+  sl_hash_rows_func_t hash_rows;
+};
+
+// Returns the fastest hash kernel supported by the running CPU. All kernels
+// produce identical hashes for the same input.
+const struct sl_hash_kernel* sl_copy_hash_kernel();
+
+// Returns every hash kernel supported by the running CPU, starting with the
+// scalar one. Exported for testing and benchmarking.
+const struct sl_hash_kernel* const* sl_copy_supported_hash_kernels(
+    size_t* count);
+
+// Source and destination of a damage copy. Both images share the same pixel
+// layout; only their addresses, plane offsets and strides differ.
+struct sl_copy_job {
+  const struct sl_copy_kernel* kernel;
+  uint8_t* src_addr;
+  size_t src_offset[2];
+  size_t src_stride[2];
+  uint8_t* dst_addr;
+  size_t dst_offset[2];
+  size_t dst_stride[2];
+  size_t bpp;
+  size_t num_planes;
+  size_t y_ss[2];
+  int32_t width;
+  int32_t height;
+};
+
+// A rectangle of the buffer to copy, in plane 0 pixels.
+struct sl_copy_span {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  // True if the span covers whole rows and source and destination strides
+  // match, so each plane can be copied as a single block including the row
+  // padding.
+  bool contiguous;
+};
+
+// Turns `damage`, in buffer coordinates, into a list of spans that is cheap
+// to copy. Damage is clipped to the job's size. Rectangles are merged into
+// their bounding box when copying the extra pixels costs less than the
+// per-span and per-row overhead saved.
+void sl_copy_plan(const struct sl_copy_job* job,
+                  pixman_region32_t* damage,
+                  std::vector<struct sl_copy_span>* spans);
+
+// Returns the number of pixel bytes covered by `spans`, summed over all planes.
+size_t sl_copy_plan_bytes(const struct sl_copy_job* job,
+                          const std::vector<struct sl_copy_span>& spans);
+
+// Copies `span` from the job's source to its destination. Returns the number
+// of bytes copied.
+size_t sl_copy_span_execute(const struct sl_copy_job* job,
+                            const struct sl_copy_span* span);
+
+// Size, in plane 0 pixels, of the square tiles content hashes are kept for.
+#define SL_COPY_TILE_SIZE 64
+
+// Content hashes of the tiles of a buffer, in row-major order. 0 means the
+// content of the tile is unknown.
+struct sl_copy_tile_hashes {
+  int32_t width = 0;
+  int32_t height = 0;
+  std::vector<uint64_t> hashes;
+};
+
+// Resizes `tiles` for a buffer of `width`x`height` pixels. All hashes are
+// forgotten if the size changes.
+void sl_copy_tile_hashes_reset(struct sl_copy_tile_hashes* tiles,
+                               int32_t width,
+                               int32_t height);
+
+// Hashes the source tiles touched by `copy_damage` or `host_damage`, both in
+// buffer coordinates, and drops tiles whose content did not change.
+// `copy_tiles` holds the hashes of the job's destination and `host_tiles`
+// those of the content last shown by the host. `copy_damage` is replaced by
+// the changed tiles it touches, rounded out to whole tiles, and `host_damage`
+// is clipped to the changed tiles. Both hash sets are updated.
+void sl_copy_reduce_damage(const struct sl_copy_job* job,
+                           const struct sl_hash_kernel* kernel,
+                           pixman_region32_t* copy_damage,
+                           struct sl_copy_tile_hashes* copy_tiles,
+                           pixman_region32_t* host_damage,
+                           struct sl_copy_tile_hashes* host_tiles);
+
+// Faults in the `size` bytes of the shared mapping at `addr` for writing in
+// a single call, rather than one page at a time during the first copy into
+// it. Large mappings also ask for transparent huge pages. Returns false if
+// the kernel cannot populate the mapping up front.
+bool sl_copy_prefault(void* addr, size_t size);
+
+// Pool of worker threads used to copy large damage in parallel.
+struct sl_copy_pool;
+
+// Creates a pool with `num_threads` workers. The calling thread also takes
+// part in every copy, so `num_threads + 1` cores can be busy at once.
+struct sl_copy_pool* sl_copy_pool_create(int num_threads);
+
+void sl_copy_pool_destroy(struct sl_copy_pool* pool);
+
+// Copies all `spans` of `job` and returns the number of bytes copied. If
+// `pool` is non-NULL and at least `threshold` bytes need to be copied, the
+// spans are split into horizontal bands that are copied in parallel. Always
+// returns after every band has been copied.
+size_t sl_copy_pool_run(struct sl_copy_pool* pool,
+                        const struct sl_copy_job* job,
+                        const std::vector<struct sl_copy_span>& spans,
+                        size_t threshold);
+
+// Runs copies on a background thread, in submission order.
+struct sl_copy_queue;
+
+// Creates a queue whose thread uses `pool` (may be NULL) for copies of at
+// least `threshold` bytes. The pool must not be used by anyone else while
+// the queue exists.
+struct sl_copy_queue* sl_copy_queue_create(struct sl_copy_pool* pool,
+                                           size_t threshold);
+
+// Waits for queued copies to finish, then destroys the queue.
+void sl_copy_queue_destroy(struct sl_copy_queue* queue);
+
+// Returns an eventfd that becomes readable when a copy has completed.
+int sl_copy_queue_fd(struct sl_copy_queue* queue);
+
+// Queues a copy of `spans`. The memory described by `job` must stay valid
+// until the copy has completed. Returns a ticket that identifies the copy;
+// tickets increase with every submission and are never 0.
+uint64_t sl_copy_queue_submit(struct sl_copy_queue* queue,
+                              const struct sl_copy_job* job,
+                              std::vector<struct sl_copy_span> spans);
+
+// Retrieves the oldest completed copy that has not been retrieved yet.
+// Returns false if there is none. Also clears the eventfd.
+bool sl_copy_queue_poll(struct sl_copy_queue* queue,
+                        uint64_t* ticket,
+                        size_t* bytes_copied);
+
+// Blocks until the copy identified by `ticket` and all copies submitted
+// before it have completed.
+void sl_copy_queue_wait(struct sl_copy_queue* queue, uint64_t ticket);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_COPY_H_
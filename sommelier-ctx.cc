@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <cerrno>
+#include <poll.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -13,10 +14,19 @@
 
 #include "aura-shell-client-protocol.h"  // NOLINT(build/include_directory)
 #include "sommelier.h"                   // NOLINT(build/include_directory)
+#include "sommelier-stats.h"             // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"           // NOLINT(build/include_directory)
 
 // TODO(b/173147612): Use container_token rather than this name.
 #define DEFAULT_VM_NAME "termina"
+#define DEFAULT_COPY_PARALLEL_THRESHOLD (4 * 1024 * 1024)
+#define DEFAULT_BUFFER_POOL_SIZE (32 * 1024 * 1024)
+
+// Reads from the virtwl socket per wakeup before yielding to other events.
+#define VIRTWL_SOCKET_MAX_READS 64
+
+// Channel events handled per wakeup before yielding to other events.
+#define WAYLAND_CHANNEL_MAX_EVENTS 64
 
 // Returns the string mapped to the given ATOM_ enum value.
 //
@@ -129,6 +139,7 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->vm_id = DEFAULT_VM_NAME;
   ctx->drm_device = NULL;
   ctx->gbm = NULL;
+  ctx->drm_resource_fd = -1;
   ctx->xwayland = 0;
   ctx->xwayland_pid = -1;
   ctx->child_pid = -1;
@@ -184,6 +195,31 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->enable_xshape = false;
   ctx->trace_system = false;
   ctx->use_direct_scale = false;
+  ctx->copy_threads = 0;
+  ctx->copy_parallel_threshold = DEFAULT_COPY_PARALLEL_THRESHOLD;
+  ctx->copy_pool = NULL;
+  ctx->async_commit = false;
+  ctx->copy_queue = NULL;
+  ctx->shm_import = false;
+  ctx->buffer_pool_size = DEFAULT_BUFFER_POOL_SIZE;
+  ctx->output_buffer_pool_bytes = 0;
+  ctx->idle_trim_timeout_ms = 0;
+  ctx->client_memory_limit = 0;
+  ctx->buffer_size_bucket = 0;
+  ctx->buffer_queue_depth = 0;
+  ctx->buffer_queue_adaptive = false;
+  ctx->tile_hash_damage = false;
+  ctx->prefault_buffers = false;
+  ctx->prefault_dmabuf_unsupported = false;
+  ctx->async_fence_wait = true;
+  ctx->fence_export_unsupported = false;
+  ctx->memory_pressure_file = "/proc/pressure/memory";
+  ctx->memory_pressure_stall_us = 0;
+  ctx->memory_pressure_window_us = 1000000;
+  ctx->memory_pressure_queue_depth = 1;
+  ctx->memory_pressure_hold_ms = 10000;
+  ctx->memory_pressure = false;
+  ctx->stats = false;
 
   wl_list_init(&ctx->accelerators);
   wl_list_init(&ctx->windowed_accelerators);
@@ -195,6 +231,10 @@ void sl_context_init_default(struct sl_context* ctx) {
   wl_list_init(&ctx->unpaired_windows);
   wl_list_init(&ctx->host_outputs);
   wl_list_init(&ctx->selection_data_source_send_pending);
+  wl_list_init(&ctx->pending_commits);
+  wl_list_init(&ctx->output_buffer_pool);
+  wl_list_init(&ctx->host_surfaces);
+  wl_list_init(&ctx->drm_resources);
 #ifdef GAMEPAD_SUPPORT
   wl_list_init(&ctx->gamepads);
 #endif
@@ -225,9 +265,10 @@ static int sl_handle_clipboard_event(int fd, uint32_t mask, void* data) {
   return 1;
 }
 
-static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
-  TRACE_EVENT("surface", "sl_handle_wayland_channel_event");
-  struct sl_context* ctx = (struct sl_context*)data;
+// Handles a single event on the channel and forwards what it received to the
+// client. Returns false if the channel failed, in which case the connection
+// to the client has been closed.
+static bool sl_wayland_channel_handle_one(struct sl_context* ctx, int fd) {
   struct WaylandSendReceive receive = {0};
   int pipe_read_fd = -1;
   enum WaylandChannelEvent event_type = WaylandChannelEvent::None;
@@ -238,20 +279,12 @@ static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
   ssize_t bytes;
   int rv;
 
-  if (!(mask & WL_EVENT_READABLE)) {
-    fprintf(stderr,
-            "Got error or hangup on virtwl ctx fd"
-            " (mask %d), exiting\n",
-            mask);
-    exit(EXIT_SUCCESS);
-  }
-
   receive.channel_fd = fd;
   rv = ctx->channel->handle_channel_event(event_type, receive, pipe_read_fd);
   if (rv) {
     close(ctx->virtwl_socket_fd);
     ctx->virtwl_socket_fd = -1;
-    return 0;
+    return false;
   }
 
   if (event_type == WaylandChannelEvent::ReceiveAndProxy) {
@@ -262,7 +295,7 @@ static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
         wl_event_loop_add_fd(event_loop, pipe_read_fd, WL_EVENT_READABLE,
                              sl_handle_clipboard_event, ctx));
   } else if (event_type != WaylandChannelEvent::Receive) {
-    return 1;
+    return true;
   }
 
   buffer_iov.iov_base = receive.data;
@@ -289,28 +322,79 @@ static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
 
   bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
   errno_assert(bytes == static_cast<ssize_t>(receive.data_size));
+  sl_stats_add(SL_STAT_CHANNEL_RECEIVES, 1);
 
   while (receive.num_fds--)
     close(receive.fds[receive.num_fds]);
 
-  if (receive.data)
-    free(receive.data);
+  // The data was sent straight from the channel's memory, which it can now
+  // reuse.
+  rv = ctx->channel->release_receive();
+  if (rv) {
+    close(ctx->virtwl_socket_fd);
+    ctx->virtwl_socket_fd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+static bool sl_wayland_channel_ready(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("surface", "sl_handle_wayland_channel_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+  int events;
+
+  if (!(mask & WL_EVENT_READABLE)) {
+    fprintf(stderr,
+            "Got error or hangup on virtwl ctx fd"
+            " (mask %d), exiting\n",
+            mask);
+    exit(EXIT_SUCCESS);
+  }
+
+  // Handle every event that is already pending instead of going back to the
+  // event loop after each one, so bursts from the host (e.g. input) are not
+  // delivered one dispatch at a time. Handling an event must not block, so
+  // each further one is only handled once the channel fd polls readable.
+  for (events = 0; events < WAYLAND_CHANNEL_MAX_EVENTS; ++events) {
+    if (events && !sl_wayland_channel_ready(fd))
+      break;
+    if (!sl_wayland_channel_handle_one(ctx, fd))
+      return 0;
+  }
+  sl_stats_add(SL_STAT_CHANNEL_WAKEUPS, 1);
 
   return 1;
 }
 
+// Submits the messages batched in `send` to the channel and closes the FDs
+// that went with them.
+static void sl_virtwl_socket_flush(struct sl_context* ctx,
+                                   struct WaylandSendReceive* send) {
+  int rv;
+
+  send->channel_fd = ctx->wayland_channel_fd;
+  rv = ctx->channel->send(*send);
+  errno_assert(!rv);
+  sl_stats_add(SL_STAT_CHANNEL_SENDS, 1);
+
+  while (send->num_fds)
+    close(send->fds[--send->num_fds]);
+  send->data_size = 0;
+}
+
 static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_virtwl_socket_event");
   struct sl_context* ctx = (struct sl_context*)data;
   struct WaylandSendReceive send = {0};
-  char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
-  uint8_t data_buffer[DEFAULT_BUFFER_SIZE];
-
-  struct iovec buffer_iov;
-  struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
-  ssize_t bytes;
-  int rv;
+  size_t capacity = ctx->channel->max_send_size();
+  int reads;
 
   if (!(mask & WL_EVENT_READABLE)) {
     fprintf(stderr,
@@ -320,45 +404,80 @@ static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
     exit(EXIT_SUCCESS);
   }
 
-  buffer_iov.iov_base = data_buffer;
-  buffer_iov.iov_len = ctx->channel->max_send_size();
+  // Read straight into the channel's command when it has one, so the
+  // messages are not copied again on their way to the host.
+  send.data = ctx->channel->send_buffer();
+  if (!send.data) {
+    if (ctx->virtwl_socket_buffer.size() < capacity)
+      ctx->virtwl_socket_buffer.resize(capacity);
+    send.data = ctx->virtwl_socket_buffer.data();
+  }
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+  // Drain the socket and pack what the client wrote into as few channel
+  // submissions as possible, as every submission is a round trip to the
+  // host. Bounded so that a busy client cannot starve the event loop; the
+  // socket stays readable if data is left.
+  for (reads = 0; reads < VIRTWL_SOCKET_MAX_READS; ++reads) {
+    char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
+    int fds[WAYLAND_MAX_FDs];
+    uint32_t num_fds = 0;
+    struct iovec buffer_iov;
+    struct msghdr msg = {0};
+    struct cmsghdr* cmsg;
+    ssize_t bytes;
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+    buffer_iov.iov_base = send.data + send.data_size;
+    buffer_iov.iov_len = capacity - send.data_size;
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+    msg.msg_iov = &buffer_iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = sizeof(fd_buffer);
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+    bytes = recvmsg(ctx->virtwl_socket_fd, &msg, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    errno_assert(bytes > 0);
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    // If there were any FDs recv'd by recvmsg, there will be some data in
+    // the msg_control buffer. To get the FDs out we iterate all cmsghdr's
+    // within and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+    for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      size_t cmsg_fd_count;
 
-    // fd_count will never exceed WAYLAND_MAX_FDs because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&send.fds[send.num_fds], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    send.num_fds += cmsg_fd_count;
-  }
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
 
-  send.channel_fd = ctx->wayland_channel_fd;
-  send.data = data_buffer;
-  send.data_size = bytes;
+      cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
 
-  rv = ctx->channel->send(send);
-  errno_assert(!rv);
+      // fd_count will never exceed WAYLAND_MAX_FDs because the
+      // control message buffer only allocates enough space for that many
+      // FDs.
+      memcpy(&fds[num_fds], CMSG_DATA(cmsg), cmsg_fd_count * sizeof(int));
+      num_fds += cmsg_fd_count;
+    }
+
+    // FDs are never merged with those of an earlier read, so every
+    // submission carries no more FDs than the channel accepted before
+    // batching. The bytes just read start the next submission instead.
+    if (num_fds && send.num_fds) {
+      uint8_t* chunk = send.data + send.data_size;
+
+      sl_virtwl_socket_flush(ctx, &send);
+      memmove(send.data, chunk, bytes);
+    }
+
+    memcpy(&send.fds[send.num_fds], fds, num_fds * sizeof(int));
+    send.num_fds += num_fds;
+    send.data_size += bytes;
+    if (send.data_size == capacity)
+      sl_virtwl_socket_flush(ctx, &send);
+  }
 
-  while (send.num_fds--)
-    close(send.fds[send.num_fds]);
+  if (send.data_size)
+    sl_virtwl_socket_flush(ctx, &send);
+  sl_stats_add(SL_STAT_CHANNEL_SOCKET_READS, reads);
 
   return 1;
 }
@@ -7,6 +7,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <xcb/xcb.h>
@@ -95,11 +96,18 @@ struct sl_context {
   int wm_fd;
   int wayland_channel_fd;
   int virtwl_socket_fd;
+  // Messages read from virtwl_socket_fd, batched for channels without a
+  // send_buffer().
+  std::vector<uint8_t> virtwl_socket_buffer;
   int virtwl_display_fd;
   std::unique_ptr<struct wl_event_source> wayland_channel_event_source;
   std::unique_ptr<struct wl_event_source> virtwl_socket_event_source;
   const char* drm_device;
   struct gbm_device* gbm;
+  // GEM handles of the DRM PRIME buffers clients have shared with us, and a
+  // second fd for the DRM device that owns them, or -1.
+  struct wl_list drm_resources;
+  int drm_resource_fd;
   int xwayland;
   pid_t xwayland_pid;
   // XWayland-hosting sommelier instances allow additional connections for IME
@@ -188,6 +196,76 @@ struct sl_context {
   bool use_explicit_fence;
   bool use_virtgpu_channel;
   bool use_direct_scale;
+  // Number of worker threads used for damage copies, 0 to copy on the main
+  // thread only.
+  int copy_threads;
+  // Minimum number of bytes a commit must copy before the copy is split
+  // across copy_threads.
+  size_t copy_parallel_threshold;
+  // Created on first use, so that no threads exist while child processes are
+  // being spawned.
+  struct sl_copy_pool* copy_pool;
+  // Copy damage on a background thread and forward the commit to the host
+  // once the copy has completed.
+  bool async_commit;
+  struct sl_copy_queue* copy_queue;
+  std::unique_ptr<struct wl_event_source> copy_queue_event_source;
+  // Commits waiting for their copy, or for earlier commits, in the order
+  // they were made.
+  struct wl_list pending_commits;
+  // Share memfd-backed wl_shm buffers with the host directly, instead of
+  // copying them into output buffers, when the channel supports it.
+  bool shm_import;
+  // Output buffers released by their surface, most recently used first, kept
+  // for reuse by any surface up to a total of buffer_pool_size bytes.
+  size_t buffer_pool_size;
+  struct wl_list output_buffer_pool;
+  size_t output_buffer_pool_bytes;
+  // All host surfaces, and a timer that frees the released output buffers of
+  // those that have not committed for idle_trim_timeout_ms. 0 to keep them.
+  struct wl_list host_surfaces;
+  uint32_t idle_trim_timeout_ms;
+  std::unique_ptr<struct wl_event_source> idle_trim_timer;
+  // Output buffer memory a client may hold across its surfaces before its
+  // released buffers are freed and it is held to double buffering. 0 for no
+  // limit.
+  size_t client_memory_limit;
+  // Round output buffer sizes up to a multiple of this many pixels, so that
+  // resizing windows can keep using the same buffer. 0 to disable.
+  uint32_t buffer_size_bucket;
+  // Number of output buffers each surface keeps, 0 for as many as the host
+  // holds on to. With buffer_queue_adaptive, the depth of each surface
+  // follows how long the host holds its buffers instead.
+  int buffer_queue_depth;
+  bool buffer_queue_adaptive;
+  // Hash the contents of damaged tiles and drop damage over tiles that did
+  // not change, both from the copy into the output buffer and from the
+  // damage forwarded to the host.
+  bool tile_hash_damage;
+  // Fault in newly allocated output buffers before the first copy into them.
+  bool prefault_buffers;
+  // Set once faulting in a dma-buf output buffer has failed. Mappings of
+  // host memory (VM_PFNMAP) cannot be populated, so it is not tried again.
+  bool prefault_dmabuf_unsupported;
+  // Wait for client GPU rendering on the event loop rather than blocking in
+  // sl_host_surface_attach(), when the kernel can export dma-buf fences.
+  bool async_fence_wait;
+  bool fence_export_unsupported;
+  // Free cached buffers when the memory stall time in the PSI file
+  // memory_pressure_file exceeds memory_pressure_stall_us within
+  // memory_pressure_window_us, then keep at most memory_pressure_queue_depth
+  // buffers per surface for memory_pressure_hold_ms. 0 stall to disable.
+  const char* memory_pressure_file;
+  uint32_t memory_pressure_stall_us;
+  uint32_t memory_pressure_window_us;
+  int memory_pressure_queue_depth;
+  uint32_t memory_pressure_hold_ms;
+  bool memory_pressure;
+  std::unique_ptr<struct wl_event_source> memory_pressure_event_source;
+  std::unique_ptr<struct wl_event_source> memory_pressure_timer;
+  // Dump sommelier-stats.h counters, and the memory held per client, on
+  // SIGUSR1.
+  bool stats;
   // Never freed after allocation due the fact sommelier doesn't have a
   // shutdown function yet.
   WaylandChannel* channel;
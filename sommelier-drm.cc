@@ -3,13 +3,17 @@
 // found in the LICENSE file.
 
 #include "sommelier.h"          // NOLINT(build/include_directory)
+#include "sommelier-stats.h"    // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"  // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <errno.h>
 #include <gbm.h>
 #include <libdrm/drm_fourcc.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -60,34 +64,107 @@ static void sl_drm_create_planar_buffer(struct wl_client* client,
   assert(0);
 }
 
-static void sl_drm_sync(struct sl_context* ctx,
-                        struct sl_sync_point* sync_point) {
-  int drm_fd = gbm_device_get_fd(ctx->gbm);
+// GEM handle of a DRM PRIME buffer, shared by every buffer that refers to the
+// same underlying resource. Handles are imported on ctx->drm_resource_fd
+// rather than the GBM device's fd: importing the same dma-buf twice on one
+// fd yields the same handle, and GBM closes the handles of the buffer
+// objects it destroys without knowing about ours.
+struct sl_drm_resource {
+  struct sl_context* ctx;
+  struct wl_list link;
+  int refcount;
+  // Identity of the dma-buf the handle was imported from.
+  dev_t dev;
+  ino_t ino;
+  uint32_t handle;
+  // True if virtio-gpu resource information is available for the buffer.
+  bool is_gpu_buffer;
+  // Stride reported by virtio-gpu, or 0 if unknown.
+  uint32_t stride;
+};
+
+struct sl_drm_resource* sl_drm_resource_get(struct sl_context* ctx, int fd) {
+  int drm_fd = ctx->drm_resource_fd;
+  struct sl_drm_resource* resource;
   struct drm_prime_handle prime_handle;
+  struct drm_virtgpu_resource_info_cros info_arg;
+  struct stat st;
   int ret;
 
-  // First imports the prime fd to a gem handle. This will fail if this
-  // function was not passed a prime handle that can be imported by the drm
-  // device given to sommelier.
+  if (drm_fd < 0 || fstat(fd, &st))
+    return NULL;
+
+  wl_list_for_each(resource, &ctx->drm_resources, link) {
+    if (resource->dev == st.st_dev && resource->ino == st.st_ino) {
+      sl_stats_add(SL_STAT_DRM_PRIME_CACHE_HITS, 1);
+      return sl_drm_resource_ref(resource);
+    }
+  }
+
+  // Imports the prime fd to a gem handle. This will fail if this function
+  // was not passed a prime handle that can be imported by the drm device
+  // given to sommelier.
+  TRACE_EVENT("drm", "sl_drm_resource_get: import", "prime_fd", fd);
   memset(&prime_handle, 0, sizeof(prime_handle));
-  prime_handle.fd = sync_point->fd;
-  TRACE_EVENT("drm", "sl_drm_sync", "prime_fd", prime_handle.fd);
+  prime_handle.fd = fd;
   ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-  if (!ret) {
-    struct drm_virtgpu_3d_wait wait_arg;
-    struct drm_gem_close gem_close;
-
-    // Then attempts to wait for GPU operations to complete. This will fail
-    // silently if the drm device passed to sommelier is not a virtio-gpu
-    // device.
-    memset(&wait_arg, 0, sizeof(wait_arg));
-    wait_arg.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
-
-    // Always close the handle we imported.
-    memset(&gem_close, 0, sizeof(gem_close));
-    gem_close.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+  if (ret)
+    return NULL;
+  sl_stats_add(SL_STAT_DRM_PRIME_IMPORTS, 1);
+
+  resource = new sl_drm_resource();
+  resource->ctx = ctx;
+  resource->refcount = 1;
+  resource->dev = st.st_dev;
+  resource->ino = st.st_ino;
+  resource->handle = prime_handle.handle;
+
+  // Then attempts to get resource information. This will fail silently if
+  // the drm device passed to sommelier is not a virtio-gpu device.
+  memset(&info_arg, 0, sizeof(info_arg));
+  info_arg.bo_handle = prime_handle.handle;
+  info_arg.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
+  ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &info_arg);
+  resource->is_gpu_buffer = !ret;
+  resource->stride = ret ? 0 : info_arg.stride;
+
+  wl_list_insert(&ctx->drm_resources, &resource->link);
+  return resource;
+}
+
+struct sl_drm_resource* sl_drm_resource_ref(struct sl_drm_resource* resource) {
+  resource->refcount++;
+  return resource;
+}
+
+void sl_drm_resource_unref(struct sl_drm_resource* resource) {
+  struct drm_gem_close gem_close;
+
+  if (--resource->refcount)
+    return;
+
+  memset(&gem_close, 0, sizeof(gem_close));
+  gem_close.handle = resource->handle;
+  drmIoctl(resource->ctx->drm_resource_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+  wl_list_remove(&resource->link);
+  delete resource;
+}
+
+static void sl_drm_sync(struct sl_context* ctx,
+                        struct sl_sync_point* sync_point) {
+  struct drm_virtgpu_3d_wait wait_arg;
+  int ret;
+
+  // Waits for GPU operations on the buffer to complete. The GEM handle is
+  // only valid on the fd it was imported on. Sync points only carry a
+  // resource for virtio-gpu buffers, so the wait is expected to succeed.
+  TRACE_EVENT("drm", "sl_drm_sync", "prime_fd", sync_point->fd);
+  memset(&wait_arg, 0, sizeof(wait_arg));
+  wait_arg.handle = sync_point->drm_resource->handle;
+  ret = drmIoctl(ctx->drm_resource_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
+  if (ret) {
+    fprintf(stderr, "warning: failed to wait for GPU rendering: %s\n",
+            strerror(errno));
   }
 }
 
@@ -117,41 +194,19 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
 
   // Attempts to correct stride0 with virtio-gpu specific resource information,
   // if available.  Ideally mesa/gbm should have the correct stride. Remove
-  // after crbug.com/892242 is resolved in mesa.
-  int is_gpu_buffer = 0;
+  // after crbug.com/892242 is resolved in mesa. The GEM handle and resource
+  // information are kept for as long as the buffer exists, so that clients
+  // recreating buffers for the same resource, and every sync of the buffer,
+  // need no further ioctls.
+  struct sl_drm_resource* drm_resource = NULL;
   if (host->ctx->gbm) {
-    int drm_fd = gbm_device_get_fd(host->ctx->gbm);
-    struct drm_prime_handle prime_handle;
-    int ret;
-
-    // First imports the prime fd to a gem handle. This will fail if this
-    // function was not passed a prime handle that can be imported by the drm
-    // device given to sommelier.
-    memset(&prime_handle, 0, sizeof(prime_handle));
-    prime_handle.fd = name;
-    ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-    if (!ret) {
-      struct drm_virtgpu_resource_info_cros info_arg;
-      struct drm_gem_close gem_close;
-
-      // Then attempts to get resource information. This will fail silently if
-      // the drm device passed to sommelier is not a virtio-gpu device.
-      memset(&info_arg, 0, sizeof(info_arg));
-      info_arg.bo_handle = prime_handle.handle;
-      info_arg.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
-      ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &info_arg);
-      // Correct stride0 if we are able to get proper resource info.
-      if (!ret) {
-        if (info_arg.stride)
-          stride0 = info_arg.stride;
-        is_gpu_buffer = 1;
-      }
-
-      // Always close the handle we imported.
-      memset(&gem_close, 0, sizeof(gem_close));
-      gem_close.handle = prime_handle.handle;
-      drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    drm_resource = sl_drm_resource_get(host->ctx, name);
+    if (drm_resource && !drm_resource->is_gpu_buffer) {
+      sl_drm_resource_unref(drm_resource);
+      drm_resource = NULL;
     }
+    if (drm_resource && drm_resource->stride)
+      stride0 = drm_resource->stride;
   }
 
   buffer_params =
@@ -165,9 +220,10 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
                             zwp_linux_buffer_params_v1_create_immed(
                                 buffer_params, width, height, format, 0),
                             width, height, /*is_drm=*/true);
-  if (is_gpu_buffer) {
+  if (drm_resource) {
     host_buffer->sync_point = sl_sync_point_create(name);
     host_buffer->sync_point->sync = sl_drm_sync;
+    host_buffer->sync_point->drm_resource = drm_resource;
     host_buffer->shm_format = sl_shm_format_for_drm_format(format);
 
     // Create our DRM PRIME mmap container
@@ -179,6 +235,8 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
     // For this reason, the GBM mapping API's will not be used until we
     // are absolutely certain that the buffers contents need to be
     // accessed. This will be done through a call to sl_mmap_begin_access.
+    // The imported buffer object is then kept for the lifetime of the
+    // container, so that only the mapping is repeated for every commit.
     //
     // We are also checking for a single plane format as this container
     // is currently only defined for single plane format buffers.
@@ -5,9 +5,11 @@
 #include "sommelier-mmap.h"  // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "sommelier.h"          // NOLINT(build/include_directory)
+#include "sommelier-stats.h"    // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"  // NOLINT(build/include_directory)
 
 struct sl_mmap* sl_mmap_create(int fd,
@@ -39,6 +41,7 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
+  map->shm_mapping = NULL;
   map->addr =
       mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   errno_assert(map->addr != MAP_FAILED);
@@ -46,6 +49,96 @@ struct sl_mmap* sl_mmap_create(int fd,
   return map;
 }
 
+struct sl_mmap* sl_mmap_create_view(struct sl_shm_mapping* mapping,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1) {
+  TRACE_EVENT("shm", "sl_mmap_create_view");
+  struct sl_mmap* map = new sl_mmap();
+
+  assert(size + offset0 <= mapping->size);
+
+  map->refcount = 1;
+  map->fd = -1;
+  map->size = size;
+  map->map_type = SL_MMAP_SHM;
+  map->gbm_map_data = NULL;
+  map->gbmbo = NULL;
+  map->num_planes = num_planes;
+  map->bpp = bpp;
+  map->offset[0] = offset0;
+  map->stride[0] = stride0;
+  map->offset[1] = offset1;
+  map->stride[1] = stride1;
+  map->y_ss[0] = y_ss0;
+  map->y_ss[1] = y_ss1;
+  map->begin_write = NULL;
+  map->end_write = NULL;
+  map->buffer_resource = NULL;
+  map->shm_mapping = mapping;
+  mapping->refcount++;
+  // Offsets are relative to the start of the pool, as for sl_mmap_create().
+  map->addr = mapping->addr;
+
+  return map;
+}
+
+struct sl_shm_mapping* sl_shm_mapping_create(int fd, size_t size) {
+  TRACE_EVENT("shm", "sl_shm_mapping_create", "size", size);
+  void* addr;
+
+  if (!size)
+    return NULL;
+
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  struct sl_shm_mapping* mapping = new sl_shm_mapping();
+  mapping->refcount = 1;
+  mapping->addr = addr;
+  mapping->size = size;
+  return mapping;
+}
+
+bool sl_shm_mapping_grow(struct sl_shm_mapping** mapping, int fd, size_t size) {
+  struct sl_shm_mapping* old_mapping = *mapping;
+  struct sl_shm_mapping* new_mapping;
+
+  if (size <= old_mapping->size)
+    return true;
+
+  TRACE_EVENT("shm", "sl_shm_mapping_grow", "size", size);
+  // Only grow in place, as copies may be reading from the mapping on
+  // another thread.
+  if (mremap(old_mapping->addr, old_mapping->size, size, 0) != MAP_FAILED) {
+    old_mapping->size = size;
+    return true;
+  }
+
+  new_mapping = sl_shm_mapping_create(fd, size);
+  if (!new_mapping)
+    return false;
+
+  sl_shm_mapping_unref(old_mapping);
+  *mapping = new_mapping;
+  return true;
+}
+
+void sl_shm_mapping_unref(struct sl_shm_mapping* mapping) {
+  if (--mapping->refcount)
+    return;
+
+  munmap(mapping->addr, mapping->size);
+  delete mapping;
+}
+
 struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
                                          int fd,
                                          size_t bpp,
@@ -71,6 +164,7 @@ struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
+  map->shm_mapping = NULL;
   map->map_type = SL_MMAP_DRM_PRIME;
   map->gbm_map_data = NULL;
   map->addr = NULL;
@@ -95,7 +189,20 @@ struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
 }
 
 bool sl_mmap_begin_access(struct sl_mmap* map) {
+  if (map->map_type != SL_MMAP_DRM_PRIME)
+    return true;
+
+  return sl_mmap_begin_access_rect(map, 0, 0, map->gbm_import_data.width,
+                                   map->gbm_import_data.height);
+}
+
+bool sl_mmap_begin_access_rect(struct sl_mmap* map,
+                               uint32_t x,
+                               uint32_t y,
+                               uint32_t width,
+                               uint32_t height) {
   uint32_t ret_stride;
+  uint8_t* addr;
 
   // This function is to be used on the DRM PRIME mmap path.
   // It is used to ensure we can actually access the resource
@@ -109,24 +216,45 @@ bool sl_mmap_begin_access(struct sl_mmap* map) {
   // Attempt to import (and map) the GBM BO
   // If we cannot do so, return false so the upper layers
   // can respond appropriately.
-  map->gbmbo = gbm_bo_import(map->gbm_device_object, GBM_BO_IMPORT_FD,
-                             reinterpret_cast<void*>(&map->gbm_import_data),
-                             GBM_BO_USE_LINEAR);
+  // The import is kept until the mmap is destroyed, only the mapping, which
+  // reads the contents back, has to be made again for every access.
   if (!map->gbmbo) {
-    return false;
+    map->gbmbo = gbm_bo_import(map->gbm_device_object, GBM_BO_IMPORT_FD,
+                               reinterpret_cast<void*>(&map->gbm_import_data),
+                               GBM_BO_USE_LINEAR);
+    if (!map->gbmbo) {
+      return false;
+    }
+    sl_stats_add(SL_STAT_GBM_BO_IMPORTS, 1);
   }
 
+  // Only the requested rectangle is read back, and the mapping returned
+  // starts at its top-left corner. Other planes lie outside of it, so
+  // buffers with more than one plane are always mapped as a whole.
+  if (map->num_planes != 1) {
+    x = y = 0;
+    width = map->gbm_import_data.width;
+    height = map->gbm_import_data.height;
+  }
   map->gbm_map_data = NULL;
-  map->addr = gbm_bo_map(map->gbmbo, 0, 0, map->gbm_import_data.width,
-                         map->gbm_import_data.height, GBM_BO_TRANSFER_READ,
-                         &ret_stride, &map->gbm_map_data);
-  if (!map->addr) {
+  addr = static_cast<uint8_t*>(gbm_bo_map(map->gbmbo, x, y, width, height,
+                                          GBM_BO_TRANSFER_READ, &ret_stride,
+                                          &map->gbm_map_data));
+  sl_stats_add(SL_STAT_GBM_BO_MAPS, 1);
+  if (!addr) {
+    map->addr = NULL;
     gbm_bo_destroy(map->gbmbo);
+    map->gbmbo = NULL;
     return false;
   }
+  sl_stats_add(SL_STAT_GBM_BO_MAP_BYTES,
+               static_cast<uint64_t>(width) * height * map->bpp);
 
+  map->addr = addr;
+  map->rect_x = x;
+  map->rect_y = y;
   map->stride[0] = ret_stride;
-  map->size = ret_stride * map->gbm_import_data.height;
+  map->size = static_cast<size_t>(ret_stride) * height;
 
   return true;
 }
@@ -140,11 +268,8 @@ void sl_mmap_end_access(struct sl_mmap* map) {
     map->addr = NULL;
     map->gbm_map_data = NULL;
   }
-
-  if (map->gbmbo) {
-    gbm_bo_destroy(map->gbmbo);
-    map->gbmbo = NULL;
-  }
+  map->rect_x = 0;
+  map->rect_y = 0;
 }
 
 void sl_mmap_unref(struct sl_mmap* map) {
@@ -152,7 +277,10 @@ void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount-- == 1) {
     switch (map->map_type) {
       case SL_MMAP_SHM:
-        munmap(map->addr, map->size + map->offset[0]);
+        if (map->shm_mapping)
+          sl_shm_mapping_unref(map->shm_mapping);
+        else
+          munmap(map->addr, map->size + map->offset[0]);
         if (map->fd != -1)
           close(map->fd);
         delete map;
@@ -161,6 +289,8 @@ void sl_mmap_unref(struct sl_mmap* map) {
       case SL_MMAP_DRM_PRIME:
         // Invoke end_access just in case
         sl_mmap_end_access(map);
+        if (map->gbmbo)
+          gbm_bo_destroy(map->gbmbo);
         if (map->fd != -1)
           close(map->fd);
         delete map;
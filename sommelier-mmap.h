@@ -16,6 +16,13 @@ enum slMmapType {
   SL_MMAP_DRM_PRIME  // DRM PRIME mmap type
 };
 
+// Mapping of a whole wl_shm pool, shared by the mmaps of its buffers.
+struct sl_shm_mapping {
+  int refcount;
+  void* addr;
+  size_t size;
+};
+
 struct sl_mmap {
   int refcount;
   int fd;
@@ -29,13 +36,31 @@ struct sl_mmap {
   size_t offset[2];
   size_t stride[2];
   size_t y_ss[2];
+  // Origin, in pixels, of the rectangle `addr` maps. Zero unless the
+  // mapping was made by sl_mmap_begin_access_rect().
+  uint32_t rect_x;
+  uint32_t rect_y;
   sl_begin_end_access_func_t begin_write;
   sl_begin_end_access_func_t end_write;
   slMmapType map_type;
   struct gbm_import_fd_data gbm_import_data;
   struct wl_resource* buffer_resource;
+  // Pool mapping `addr` points into, for SHM mmaps created as views. NULL if
+  // the mmap owns its mapping.
+  struct sl_shm_mapping* shm_mapping;
 };
 
+// Maps the first `size` bytes of the shm pool `fd`. Returns NULL on failure.
+struct sl_shm_mapping* sl_shm_mapping_create(int fd, size_t size);
+
+// Makes `*mapping` cover at least `size` bytes of `fd`. The mapping is grown
+// in place if possible. Otherwise `*mapping` is replaced by a new mapping,
+// and mmaps created from the old one keep using it. Returns false on
+// failure, leaving `*mapping` unchanged.
+bool sl_shm_mapping_grow(struct sl_shm_mapping** mapping, int fd, size_t size);
+
+void sl_shm_mapping_unref(struct sl_shm_mapping* mapping);
+
 struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
                                          int fd,
                                          size_t bpp,
@@ -56,7 +81,30 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t y_ss0,
                                size_t y_ss1);
 
+// Like sl_mmap_create(), but the buffer's bytes are accessed through the
+// pool mapping `mapping` rather than mapped again. The buffer must lie
+// within the mapping.
+struct sl_mmap* sl_mmap_create_view(struct sl_shm_mapping* mapping,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1);
+
 bool sl_mmap_begin_access(struct sl_mmap* map);
+// Like sl_mmap_begin_access(), but a DRM PRIME buffer with a single plane
+// only has the given rectangle read back. `addr` and `size` then describe
+// that rectangle, whose origin is kept in `rect_x` and `rect_y`. The rest of
+// the buffer's contents must not be accessed.
+bool sl_mmap_begin_access_rect(struct sl_mmap* map,
+                               uint32_t x,
+                               uint32_t y,
+                               uint32_t width,
+                               uint32_t height);
 void sl_mmap_end_access(struct sl_mmap* map);
 
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
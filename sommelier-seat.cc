@@ -59,8 +59,9 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
     host_surface = static_cast<sl_host_surface*>(
         wl_resource_get_user_data(surface_resource));
     host_surface->has_role = 1;
+    sl_host_surface_flush(host_surface);
     if (host_surface->contents_width && host_surface->contents_height)
-      wl_surface_commit(host_surface->proxy);
+      sl_host_surface_commit_to_host(host_surface);
   }
 
   sl_transform_guest_to_host(host->seat->ctx, nullptr, &hsx, &hsy);
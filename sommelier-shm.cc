@@ -18,6 +18,12 @@ struct sl_host_shm_pool {
   struct wl_resource* resource;
   struct wl_shm_pool* proxy;
   int fd;
+  // Set once the channel failed to import this pool, so that later buffers
+  // go straight to the copy path.
+  bool import_failed;
+  // Mapping of the pool that the mmaps of its buffers point into, or NULL if
+  // every buffer has to be mapped on its own.
+  struct sl_shm_mapping* mapping;
 };
 
 struct sl_host_shm {
@@ -122,6 +128,60 @@ static size_t sl_size_for_shm_format(uint32_t format,
   return total_size;
 }
 
+// Shares the part of the pool backing a buffer with the host, so the host
+// reads the client's pixels directly. Returns NULL if the pool cannot be
+// imported, in which case the buffer is copied into an output buffer on
+// commit.
+static struct wl_buffer* sl_host_shm_pool_import_buffer(
+    struct sl_host_shm_pool* host,
+    int32_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format) {
+  struct sl_context* ctx = host->shm->ctx;
+  size_t i, num_planes = sl_shm_num_planes_for_shm_format(format);
+  struct WaylandShmImportInfo import_info = {0};
+  struct WaylandBufferCreateOutput import_output = {0};
+  struct zwp_linux_buffer_params_v1* buffer_params;
+  struct wl_buffer* buffer;
+  int rv;
+
+  if (!ctx->shm_import || host->import_failed || !ctx->linux_dmabuf ||
+      !ctx->channel->supports_shm_import())
+    return NULL;
+
+  import_info.fd = host->fd;
+  import_info.offset = offset;
+  import_info.size = sl_size_for_shm_format(format, height, stride);
+  rv = ctx->channel->import_shm(import_info, import_output);
+  if (rv) {
+    // Typically the pool is not a memfd sealed against shrinking, which will
+    // not change for as long as the pool exists.
+    TRACE_EVENT("shm", "sl_host_shm_pool_import_buffer: failed", "error", rv);
+    host->import_failed = true;
+    return NULL;
+  }
+
+  buffer_params =
+      zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf->internal);
+  for (i = 0; i < num_planes; ++i) {
+    zwp_linux_buffer_params_v1_add(
+        buffer_params, import_output.fd, i,
+        import_output.offsets[0] +
+            sl_offset_for_shm_format_plane(format, height, stride, i),
+        stride, 0, 0);
+  }
+  buffer = zwp_linux_buffer_params_v1_create_immed(
+      buffer_params, width, height, sl_drm_format_for_shm_format(format), 0);
+  zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+  // The request carries its own duplicate of the fd.
+  close(import_output.fd);
+
+  return buffer;
+}
+
 static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 struct wl_resource* resource,
                                                 uint32_t id,
@@ -143,17 +203,36 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
     return;
   }
 
+  // The mapping below is still created for imported buffers, as shaped
+  // windows need to be composited into an output buffer.
   struct sl_host_buffer* host_buffer = sl_create_host_buffer(
-      host->shm->ctx, client, id, NULL, width, height, /*is_drm=*/false);
+      host->shm->ctx, client, id,
+      sl_host_shm_pool_import_buffer(host, offset, width, height, stride,
+                                     format),
+      width, height, /*is_drm=*/false);
 
   host_buffer->shm_format = format;
-  host_buffer->shm_mmap = sl_mmap_create(
-      host->fd, sl_size_for_shm_format(format, height, stride),
-      sl_shm_bpp_for_shm_format(format),
-      sl_shm_num_planes_for_shm_format(format), offset, stride,
-      offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
-      stride, sl_y_subsampling_for_shm_format_plane(format, 0),
-      sl_y_subsampling_for_shm_format_plane(format, 1));
+  size_t size = sl_size_for_shm_format(format, height, stride);
+
+  // Clients are supposed to resize the pool before creating buffers past its
+  // end, but don't rely on it.
+  if (host->mapping)
+    sl_shm_mapping_grow(&host->mapping, host->fd, offset + size);
+  if (host->mapping && offset + size <= host->mapping->size) {
+    host_buffer->shm_mmap = sl_mmap_create_view(
+        host->mapping, size, sl_shm_bpp_for_shm_format(format),
+        sl_shm_num_planes_for_shm_format(format), offset, stride,
+        offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
+        stride, sl_y_subsampling_for_shm_format_plane(format, 0),
+        sl_y_subsampling_for_shm_format_plane(format, 1));
+  } else {
+    host_buffer->shm_mmap = sl_mmap_create(
+        host->fd, size, sl_shm_bpp_for_shm_format(format),
+        sl_shm_num_planes_for_shm_format(format), offset, stride,
+        offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
+        stride, sl_y_subsampling_for_shm_format_plane(format, 0),
+        sl_y_subsampling_for_shm_format_plane(format, 1));
+  }
   // In the case of mmaps created from the client buffer, we want to be able
   // to close the FD when the client releases the shm pool (i.e. when it's
   // done transferring) as opposed to when the pool is freed (i.e. when we're
@@ -177,6 +256,10 @@ static void sl_host_shm_pool_resize(struct wl_client* client,
 
   if (host->proxy)
     wl_shm_pool_resize(host->proxy, size);
+  // Buffers created before the resize keep their view of the old mapping
+  // if it cannot grow in place.
+  if (host->mapping)
+    sl_shm_mapping_grow(&host->mapping, host->fd, size);
 }
 
 static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
@@ -187,6 +270,8 @@ static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   struct sl_host_shm_pool* host =
       static_cast<sl_host_shm_pool*>(wl_resource_get_user_data(resource));
 
+  if (host->mapping)
+    sl_shm_mapping_unref(host->mapping);
   if (host->fd >= 0)
     close(host->fd);
   if (host->proxy)
@@ -207,6 +292,8 @@ static void sl_shm_create_host_pool(struct wl_client* client,
   host_shm_pool->shm = host->shm;
   host_shm_pool->fd = -1;
   host_shm_pool->proxy = NULL;
+  host_shm_pool->import_failed = false;
+  host_shm_pool->mapping = NULL;
   host_shm_pool->resource =
       wl_resource_create(client, &wl_shm_pool_interface, 1, id);
   wl_resource_set_implementation(host_shm_pool->resource,
@@ -219,7 +306,10 @@ static void sl_shm_create_host_pool(struct wl_client* client,
     wl_shm_pool_set_user_data(host_shm_pool->proxy, host_shm_pool);
     close(fd);
   } else {
+    // Mapped once here rather than for every buffer, as some clients create
+    // a buffer for every frame.
     host_shm_pool->fd = fd;
+    host_shm_pool->mapping = sl_shm_mapping_create(fd, size);
   }
 }
 
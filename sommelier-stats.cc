@@ -0,0 +1,87 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-stats.h"  // NOLINT(build/include_directory)
+
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+
+struct sl_stat_info {
+  const char* name;
+  // Gauges hold a current value rather than counting events, so no rate is
+  // reported for them.
+  bool gauge;
+};
+
+static const struct sl_stat_info kStatInfo[SL_STAT_COUNT] = {
+    {"output_buffer_pool_hits", false},
+    {"output_buffer_pool_misses", false},
+    {"output_buffer_pool_evictions", false},
+    {"output_buffer_pool_bytes", true},
+    {"output_buffer_allocations", false},
+    {"output_buffer_allocate_ns", false},
+    {"prefault_bytes", false},
+    {"prefault_failures", false},
+    {"idle_trim_bytes", false},
+    {"memory_pressure_events", false},
+    {"memory_pressure_bytes", false},
+    {"memory_limit_bytes", false},
+    {"channel_socket_reads", false},
+    {"channel_sends", false},
+    {"channel_receives", false},
+    {"channel_wakeups", false},
+    {"tile_damage_pixels_in", false},
+    {"tile_damage_pixels_out", false},
+    {"gbm_bo_imports", false},
+    {"gbm_bo_maps", false},
+    {"gbm_bo_map_bytes", false},
+    {"drm_prime_imports", false},
+    {"drm_prime_cache_hits", false},
+    {"gpu_wait_blocked_ns", false},
+    {"gpu_waits_async", false},
+};
+
+static uint64_t stat_values[SL_STAT_COUNT];
+static uint64_t stat_values_at_last_dump[SL_STAT_COUNT];
+static struct timespec last_dump_time;
+
+void sl_stats_add(enum slStat stat, uint64_t value) {
+  assert(stat < SL_STAT_COUNT && !kStatInfo[stat].gauge);
+  stat_values[stat] += value;
+}
+
+void sl_stats_set(enum slStat stat, uint64_t value) {
+  assert(stat < SL_STAT_COUNT && kStatInfo[stat].gauge);
+  stat_values[stat] = value;
+}
+
+uint64_t sl_stats_get(enum slStat stat) {
+  assert(stat < SL_STAT_COUNT);
+  return stat_values[stat];
+}
+
+void sl_stats_dump(FILE* stream) {
+  struct timespec now;
+  double elapsed = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (last_dump_time.tv_sec || last_dump_time.tv_nsec) {
+    elapsed = (now.tv_sec - last_dump_time.tv_sec) +
+              (now.tv_nsec - last_dump_time.tv_nsec) / 1e9;
+  }
+
+  for (int i = 0; i < SL_STAT_COUNT; ++i) {
+    fprintf(stream, "%s: %" PRIu64, kStatInfo[i].name, stat_values[i]);
+    if (!kStatInfo[i].gauge && elapsed > 0) {
+      fprintf(stream, " (%.1f/s)",
+              (stat_values[i] - stat_values_at_last_dump[i]) / elapsed);
+    }
+    fprintf(stream, "\n");
+    stat_values_at_last_dump[i] = stat_values[i];
+  }
+  fflush(stream);
+
+  last_dump_time = now;
+}
@@ -0,0 +1,75 @@
+// Copyright 2026 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_STATS_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Process-wide counters and gauges, dumped on SIGUSR1 when --stats is given.
+// Only to be updated from the main thread.
+enum slStat {
+  SL_STAT_OUTPUT_BUFFER_POOL_HITS,
+  SL_STAT_OUTPUT_BUFFER_POOL_MISSES,
+  SL_STAT_OUTPUT_BUFFER_POOL_EVICTIONS,
+  SL_STAT_OUTPUT_BUFFER_POOL_BYTES,
+  SL_STAT_OUTPUT_BUFFER_ALLOCATIONS,
+  // Time the main thread spent blocked on the host allocating output buffers.
+  SL_STAT_OUTPUT_BUFFER_ALLOCATE_NS,
+  // Bytes of output buffers faulted in up front, and buffers that could not
+  // be (see --prefault-buffers).
+  SL_STAT_PREFAULT_BYTES,
+  SL_STAT_PREFAULT_FAILURES,
+  // Bytes of output buffers freed because their surface was idle (see
+  // --idle-trim-timeout).
+  SL_STAT_IDLE_TRIM_BYTES,
+  // Memory pressure notifications, and the bytes of output buffers freed in
+  // response (see --memory-pressure-stall).
+  SL_STAT_MEMORY_PRESSURE_EVENTS,
+  SL_STAT_MEMORY_PRESSURE_BYTES,
+  // Bytes of output buffers freed because their client was over its memory
+  // limit (see --client-memory-limit).
+  SL_STAT_MEMORY_LIMIT_BYTES,
+  // Reads from the client's socket and channel submissions they were packed
+  // into. Their ratio is the batching factor.
+  SL_STAT_CHANNEL_SOCKET_READS,
+  SL_STAT_CHANNEL_SENDS,
+  // Messages received from the channel and forwarded to the client, and
+  // wakeups of the channel fd they were handled in.
+  SL_STAT_CHANNEL_RECEIVES,
+  SL_STAT_CHANNEL_WAKEUPS,
+  // Damaged pixels before and after dropping unchanged tiles (see
+  // --tile-hash-damage).
+  SL_STAT_TILE_DAMAGE_PIXELS_IN,
+  SL_STAT_TILE_DAMAGE_PIXELS_OUT,
+  // GBM buffer object imports and CPU mappings of DRM PRIME buffers, and
+  // the bytes those mappings read back.
+  SL_STAT_GBM_BO_IMPORTS,
+  SL_STAT_GBM_BO_MAPS,
+  SL_STAT_GBM_BO_MAP_BYTES,
+  // DRM PRIME buffers imported as GEM handles, and lookups that found the
+  // handle of an earlier import.
+  SL_STAT_DRM_PRIME_IMPORTS,
+  SL_STAT_DRM_PRIME_CACHE_HITS,
+  // Time the main thread spent blocked waiting for client GPU rendering, and
+  // client and host fences waited for on the event loop instead.
+  SL_STAT_GPU_WAIT_BLOCKED_NS,
+  SL_STAT_GPU_WAITS_ASYNC,
+  SL_STAT_COUNT
+};
+
+// Adds `value` to the counter `stat`.
+void sl_stats_add(enum slStat stat, uint64_t value);
+
+// Sets the gauge `stat` to `value`.
+void sl_stats_set(enum slStat stat, uint64_t value);
+
+uint64_t sl_stats_get(enum slStat stat);
+
+// Writes every stat to `stream`, one per line. Counters are followed by the
+// rate at which they increased since the previous dump.
+void sl_stats_dump(FILE* stream);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_STATS_H_
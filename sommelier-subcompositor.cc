@@ -7,6 +7,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wayland-client.h>
 
 struct sl_host_subcompositor {
@@ -19,6 +20,9 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  // Resource IDs of the sub-surface and its parent.
+  uint32_t surface_id;
+  uint32_t parent_id;
 };
 MAP_STRUCTS(wl_subsurface, sl_host_subsurface);
 
@@ -27,6 +31,35 @@ static void sl_subsurface_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+// Forwards the commits still waiting for their damage copy of the surface
+// with resource ID `id`, if it still exists.
+static void sl_subsurface_flush_surface(struct wl_client* client, uint32_t id) {
+  struct wl_resource* resource = wl_client_get_object(client, id);
+
+  if (resource && !strcmp(wl_resource_get_class(resource), "wl_surface")) {
+    sl_host_surface_flush(
+        static_cast<sl_host_surface*>(wl_resource_get_user_data(resource)));
+  }
+}
+
+// The position and stacking order of a sub-surface are applied with the
+// next commit of its parent. Earlier commits of both surfaces must reach the
+// host first, or the change would be applied to an older frame.
+static void sl_subsurface_flush(struct wl_client* client,
+                                struct sl_host_subsurface* host) {
+  sl_subsurface_flush_surface(client, host->surface_id);
+  sl_subsurface_flush_surface(client, host->parent_id);
+}
+
+template <auto wl_function, typename... InArgs>
+static void sl_subsurface_forward_request(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          InArgs... args) {
+  sl_subsurface_flush(client, static_cast<sl_host_subsurface*>(
+                                  wl_resource_get_user_data(resource)));
+  ForwardRequest<wl_function>(client, resource, args...);
+}
+
 static void sl_subsurface_set_position(struct wl_client* client,
                                        struct wl_resource* resource,
                                        int32_t x,
@@ -37,14 +70,15 @@ static void sl_subsurface_set_position(struct wl_client* client,
   int32_t iy = y;
 
   sl_transform_guest_to_host(host->ctx, nullptr, &ix, &iy);
+  sl_subsurface_flush(client, host);
   wl_subsurface_set_position(host->proxy, ix, iy);
 }
 
 static const struct wl_subsurface_interface sl_subsurface_implementation = {
     sl_subsurface_destroy,
     sl_subsurface_set_position,
-    ForwardRequest<wl_subsurface_place_above>,
-    ForwardRequest<wl_subsurface_place_below>,
+    sl_subsurface_forward_request<wl_subsurface_place_above>,
+    sl_subsurface_forward_request<wl_subsurface_place_below>,
     ForwardRequest<wl_subsurface_set_sync>,
     ForwardRequest<wl_subsurface_set_desync>,
 };
@@ -86,6 +120,8 @@ static void sl_subcompositor_get_subsurface(
   host_subsurface->proxy = wl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
+  host_subsurface->surface_id = wl_resource_get_id(surface_resource);
+  host_subsurface->parent_id = wl_resource_get_id(parent_resource);
   host_surface->has_role = 1;
 }  // NOLINT(whitespace/indent)
 
@@ -6,6 +6,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 
 // Performs an asprintf operation and checks the result for validity and calls
 // abort() if there's a failure. Returns a newly allocated string rather than
@@ -22,6 +23,13 @@ __attribute__((__format__(__printf__, 1, 0))) char* sl_xasprintf(
   return str;
 }
 
+uint64_t sl_monotonic_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
 #define DEFAULT_DELETER(TypeName, DeleteFunction)            \
   namespace std {                                            \
   void default_delete<TypeName>::operator()(TypeName* ptr) { \
@@ -19,6 +19,7 @@
 class FuzzChannel : public WaylandChannel {
  private:
   int recv_fd = -1;
+  uint8_t buffer[DEFAULT_BUFFER_SIZE];
 
  public:
   int send_fd = -1;
@@ -55,10 +56,8 @@ class FuzzChannel : public WaylandChannel {
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override {
-    uint8_t* buffer = static_cast<uint8_t*>(malloc(DEFAULT_BUFFER_SIZE));
     int bytes = recv(receive.channel_fd, buffer, DEFAULT_BUFFER_SIZE, 0);
     if (bytes < 0) {
-      free(buffer);
       return -errno;
     }
 
@@ -71,17 +70,30 @@ class FuzzChannel : public WaylandChannel {
     return 0;
   }
 
+  int32_t release_receive(void) override { return 0; }
+
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override {
     return -1;
   }
 
   int32_t sync(int dmabuf_fd, uint64_t flags) override { return 0; }
+
+  bool supports_shm_import() override { return false; }
+
+  int32_t import_shm(const struct WaylandShmImportInfo& import_info,
+                     struct WaylandBufferCreateOutput& import_output) override {
+    return -1;
+  }
+
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override {
     return 0;
   }
 
   size_t max_send_size(void) override { return DEFAULT_BUFFER_SIZE; }
+  uint8_t* send_buffer(void) override { return nullptr; }
+
+  size_t release_caches(void) override { return 0; }
 };
 
 void null_logger(const char*, va_list) {}
@@ -169,8 +169,10 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 
 void sl_commit(struct sl_window* window, struct sl_host_surface* host_surface) {
   if (sl_process_pending_configure_acks(window, host_surface)) {
-    if (host_surface)
-      wl_surface_commit(host_surface->proxy);
+    if (host_surface) {
+      sl_host_surface_flush(host_surface);
+      sl_host_surface_commit_to_host(host_surface);
+    }
   }
 }
 
@@ -577,7 +579,8 @@ void sl_window_update(struct sl_window* window) {
 #ifdef COMMIT_LOOP_FIX
   sl_commit(window, host_surface);
 #else
-  wl_surface_commit(host_surface->proxy);
+  sl_host_surface_flush(host_surface);
+  sl_host_surface_commit_to_host(host_surface);
 #endif
 
   if (host_surface->contents_width && host_surface->contents_height)
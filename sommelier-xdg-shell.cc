@@ -136,6 +136,38 @@ static struct sl_host_surface* get_host_surface(
     return nullptr;
 }
 
+// Forwards a request that the host applies with the next commit of the
+// surface, after the surface's earlier commits, which may still be waiting
+// for their damage copy. Otherwise the host would apply it to an older frame.
+template <auto wl_function,
+          AllowNullResource allow_null = AllowNullResource::kNo,
+          typename... InArgs>
+static void sl_xdg_surface_forward_request(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           InArgs... args) {
+  struct sl_host_xdg_surface* host =
+      static_cast<sl_host_xdg_surface*>(wl_resource_get_user_data(resource));
+
+  if (get_host_surface(host))
+    sl_host_surface_flush(get_host_surface(host));
+  ForwardRequest<wl_function, allow_null>(client, resource, args...);
+}
+
+// As sl_xdg_surface_forward_request(), for requests on an xdg_toplevel.
+template <auto wl_function,
+          AllowNullResource allow_null = AllowNullResource::kNo,
+          typename... InArgs>
+static void sl_xdg_toplevel_forward_request(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            InArgs... args) {
+  struct sl_host_xdg_toplevel* host =
+      static_cast<sl_host_xdg_toplevel*>(wl_resource_get_user_data(resource));
+
+  if (get_host_surface(host->originator))
+    sl_host_surface_flush(get_host_surface(host->originator));
+  ForwardRequest<wl_function, allow_null>(client, resource, args...);
+}
+
 static void sl_xdg_popup_configure(void* data,
                                    struct xdg_popup* xdg_popup,
                                    int32_t x,
@@ -208,13 +240,14 @@ static const struct xdg_toplevel_interface sl_xdg_toplevel_implementation = {
     sl_xdg_toplevel_show_window_menu,
     ForwardRequest<xdg_toplevel_move, AllowNullResource::kYes>,
     ForwardRequest<xdg_toplevel_resize, AllowNullResource::kYes>,
-    ForwardRequest<xdg_toplevel_set_max_size>,
-    ForwardRequest<xdg_toplevel_set_min_size>,
-    ForwardRequest<xdg_toplevel_set_maximized>,
-    ForwardRequest<xdg_toplevel_unset_maximized>,
-    ForwardRequest<xdg_toplevel_set_fullscreen, AllowNullResource::kYes>,
-    ForwardRequest<xdg_toplevel_unset_fullscreen>,
-    ForwardRequest<xdg_toplevel_set_minimized>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_set_max_size>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_set_min_size>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_set_maximized>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_unset_maximized>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_set_fullscreen,
+                                    AllowNullResource::kYes>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_unset_fullscreen>,
+    sl_xdg_toplevel_forward_request<xdg_toplevel_set_minimized>,
 };
 
 static void sl_xdg_toplevel_configure(void* data,
@@ -326,13 +359,15 @@ static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
   sl_transform_guest_to_host(host->ctx, host->originator, &x1, &y1);
   sl_transform_guest_to_host(host->ctx, host->originator, &x2, &y2);
 
+  if (host->originator)
+    sl_host_surface_flush(host->originator);
   xdg_surface_set_window_geometry(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
 static const struct xdg_surface_interface sl_xdg_surface_implementation = {
     sl_xdg_surface_destroy, sl_xdg_surface_get_toplevel,
     sl_xdg_surface_get_popup, sl_xdg_surface_set_window_geometry,
-    ForwardRequest<xdg_surface_ack_configure>};
+    sl_xdg_surface_forward_request<xdg_surface_ack_configure>};
 
 static void sl_xdg_surface_configure(void* data,
                                      struct xdg_surface* xdg_surface,
@@ -135,9 +135,10 @@ void sl_xshape_generate_argb_image(struct sl_context* ctx,
                                    pixman_region32_t* shape,
                                    struct sl_mmap* src_mmap,
                                    pixman_image_t* dst_image,
-                                   uint32_t src_shm_format) {
-  int buf_width, buf_height, nrects;
-  pixman_region32_t intersect_rects;
+                                   uint32_t src_shm_format,
+                                   pixman_region32_t* damage) {
+  int buf_width, buf_height, src_width, src_height, nrects;
+  pixman_region32_t area, intersect_rects, clear_rects;
   pixman_image_t* src;
 
   assert(ctx);
@@ -155,38 +156,57 @@ void sl_xshape_generate_argb_image(struct sl_context* ctx,
   // any OOB accesses
   // In addition, we can assume the dimensions of the dst_image is
   // the same size as the input image
+  //
+  // Only the damaged part of the image needs to be generated again, the
+  // rest still matches the source.
 
+  pixman_region32_init_rect(&area, 0, 0, buf_width, buf_height);
+  if (damage)
+    pixman_region32_intersect(&area, &area, damage);
   pixman_region32_init(&intersect_rects);
-  pixman_region32_intersect_rect(&intersect_rects, shape, 0, 0, buf_width,
-                                 buf_height);
+  pixman_region32_intersect(&intersect_rects, &area, shape);
+  pixman_region32_init(&clear_rects);
+  pixman_region32_subtract(&clear_rects, &area, shape);
 
-  // With the blank destination image, we will take the source image and the
+  // With the destination image, we will take the source image and the
   // shape rectangles and generate the "stamped out" ARGB image.
   //
-  // This is accomplished by clearing out the destination image to be
-  // completely transparent as a first step. Then for each rectangular
-  // region within the shape data, we will use pixman_image_composite to
-  // copy that portion of the image from the source to the ARGB stamp out
-  // buffer.
+  // This is accomplished by clearing out the parts of the destination image
+  // outside of the shape to be completely transparent as a first step. Then
+  // for each rectangular region within the shape data, we will use
+  // pixman_image_composite to copy that portion of the image from the source
+  // to the ARGB stamp out buffer.
   //
   // pixman_image_composite is used as it will automatically perform pixel
   // format conversion for us.
 
+  // The source may only map a rectangle of the buffer, starting at
+  // (rect_x, rect_y). Damage never extends past it in that case.
+  src_width = MIN(static_cast<size_t>(buf_width - src_mmap->rect_x),
+                  src_mmap->stride[0] / src_mmap->bpp);
+  src_height = MIN(static_cast<size_t>(buf_height - src_mmap->rect_y),
+                   src_mmap->size / src_mmap->stride[0]);
   src = pixman_image_create_bits_no_clear(
-      sl_pixman_format_for_shm_format(src_shm_format), buf_width, buf_height,
+      sl_pixman_format_for_shm_format(src_shm_format), src_width, src_height,
       reinterpret_cast<uint32_t*>(src_mmap->addr), src_mmap->stride[0]);
 
-  pixman_box32_t* rects = pixman_region32_rectangles(&intersect_rects, &nrects);
-
   pixman_color_t clear = {.red = 0, .green = 0, .blue = 0, .alpha = 0};
-  pixman_box32_t dstbox = {.x1 = 0, .y1 = 0, .x2 = buf_width, .y2 = buf_height};
+  pixman_box32_t* rects = pixman_region32_rectangles(&clear_rects, &nrects);
 
-  pixman_image_fill_boxes(PIXMAN_OP_SRC, dst_image, &clear, 1, &dstbox);
+  if (nrects)
+    pixman_image_fill_boxes(PIXMAN_OP_SRC, dst_image, &clear, nrects, rects);
 
+  rects = pixman_region32_rectangles(&intersect_rects, &nrects);
   for (int i = 0; i < nrects; i++) {
-    pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dst_image, rects[i].x1,
-                           rects[i].y1, 0, 0, rects[i].x1, rects[i].y1,
-                           (rects[i].x2 - rects[i].x1),
-                           (rects[i].y2 - rects[i].y1));
+    pixman_image_composite(
+        PIXMAN_OP_SRC, src, NULL, dst_image,
+        rects[i].x1 - static_cast<int>(src_mmap->rect_x),
+        rects[i].y1 - static_cast<int>(src_mmap->rect_y), 0, 0, rects[i].x1,
+        rects[i].y1, (rects[i].x2 - rects[i].x1), (rects[i].y2 - rects[i].y1));
   }
+
+  pixman_image_unref(src);
+  pixman_region32_fini(&clear_rects);
+  pixman_region32_fini(&intersect_rects);
+  pixman_region32_fini(&area);
 }
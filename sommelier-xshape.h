@@ -14,10 +14,14 @@ void sl_handle_shape_notify(struct sl_context* ctx,
 
 void sl_shape_query(struct sl_context* ctx, xcb_window_t xwindow);
 
+// Stamps the parts of `src_mmap` inside `shape` out into `dst_image`, and
+// makes the rest transparent. Only pixels inside `damage` are generated, or
+// the whole image if `damage` is NULL.
 void sl_xshape_generate_argb_image(struct sl_context* ctx,
                                    pixman_region32_t* shape,
                                    struct sl_mmap* src_mmap,
                                    pixman_image_t* dst_image,
-                                   uint32_t src_shm_format);
+                                   uint32_t src_shm_format,
+                                   pixman_region32_t* damage);
 
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_XSHAPE_H_
@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include "sommelier.h"            // NOLINT(build/include_directory)
+#include "sommelier-stats.h"      // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"    // NOLINT(build/include_directory)
 #include "sommelier-transform.h"  // NOLINT(build/include_directory)
 #include "sommelier-xshape.h"     // NOLINT(build/include_directory)
@@ -19,6 +20,7 @@
 #include <string>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -148,12 +150,15 @@ struct sl_sync_point* sl_sync_point_create(int fd) {
   struct sl_sync_point* sync_point = new sl_sync_point();
   sync_point->fd = fd;
   sync_point->sync = NULL;
+  sync_point->drm_resource = NULL;
 
   return sync_point;
 }
 
 void sl_sync_point_destroy(struct sl_sync_point* sync_point) {
   TRACE_EVENT("sync", "sl_sync_point_destroy");
+  if (sync_point->drm_resource)
+    sl_drm_resource_unref(sync_point->drm_resource);
   close(sync_point->fd);
   delete sync_point;
 }
@@ -3081,9 +3086,89 @@ static int sl_handle_sigusr1(int signal_number, void* data) {
   if (ctx->timing != NULL) {
     ctx->timing->OutputLog();
   }
+  if (ctx->stats) {
+    sl_stats_dump(stderr);
+    sl_compositor_dump_memory(ctx, stderr);
+  }
+  return 1;
+}
+
+// Frees cached buffers when the memory stall time exceeded the PSI trigger's
+// threshold, and keeps fewer buffers per surface for a while.
+static int sl_handle_memory_pressure(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct epoll_event event;
+  size_t bytes, entries = 0;
+
+  // The event loop already polled the trigger through `fd` to wake us up,
+  // which consumed its notification, so this wakeup is the event. Drain the
+  // epoll instance without relying on what it still reports.
+  epoll_wait(fd, &event, 1, 0);
+
+  sl_stats_add(SL_STAT_MEMORY_PRESSURE_EVENTS, 1);
+  bytes = sl_compositor_release_buffers(ctx);
+  if (ctx->channel)
+    entries = ctx->channel->release_caches();
+  sl_stats_add(SL_STAT_MEMORY_PRESSURE_BYTES, bytes);
+
+  fprintf(stderr,
+          "memory pressure: freed %zu bytes of output buffers and %zu cached "
+          "buffer descriptions, keeping %d buffers per surface for %u ms\n",
+          bytes, entries, ctx->memory_pressure_queue_depth,
+          ctx->memory_pressure_hold_ms);
+  ctx->memory_pressure = true;
+  wl_event_source_timer_update(ctx->memory_pressure_timer.get(),
+                               ctx->memory_pressure_hold_ms);
   return 1;
 }
 
+static int sl_handle_memory_pressure_timeout(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  fprintf(stderr, "memory pressure: over, restoring buffer queue depth\n");
+  ctx->memory_pressure = false;
+  return 1;
+}
+
+// Registers a PSI trigger on ctx->memory_pressure_file, which is either the
+// system-wide /proc/pressure/memory or a cgroup's memory.pressure. Triggers
+// signal with POLLPRI, which wl_event_loop cannot wait for, so the trigger
+// is wrapped in an epoll instance that becomes readable instead.
+static bool sl_memory_pressure_init(struct sl_context* ctx,
+                                    struct wl_event_loop* event_loop) {
+  struct epoll_event event = {};
+  char trigger[64];
+  int fd, epoll_fd;
+
+  fd = open(ctx->memory_pressure_file, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "error: cannot open %s: %s\n", ctx->memory_pressure_file,
+            strerror(errno));
+    return false;
+  }
+  snprintf(trigger, sizeof(trigger), "some %u %u",
+           ctx->memory_pressure_stall_us, ctx->memory_pressure_window_us);
+  if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+    fprintf(stderr, "error: cannot set memory pressure trigger: %s\n",
+            strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  // The trigger lasts as long as `fd` is open, so it is never closed.
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  errno_assert(epoll_fd >= 0);
+  event.events = EPOLLPRI;
+  errno_assert(!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event));
+
+  ctx->memory_pressure_event_source.reset(
+      wl_event_loop_add_fd(event_loop, epoll_fd, WL_EVENT_READABLE,
+                           sl_handle_memory_pressure, ctx));
+  ctx->memory_pressure_timer.reset(wl_event_loop_add_timer(
+      event_loop, sl_handle_memory_pressure_timeout, ctx));
+  return true;
+}
+
 static void sl_execvp(const char* file,
                       char* const argv[],
                       int wayland_socked_fd) {
@@ -3317,6 +3402,28 @@ static void sl_print_usage() {
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
       "  --timing-filename=PATH\tPath to timing output log\n"
       "  --direct-scale\t\tEnable direct scaling mode\n"
+      "  --copy-threads=N\t\tWorker threads used to copy damage\n"
+      "  --copy-parallel-threshold=BYTES\n"
+      "\tMinimum damage size copied using worker threads\n"
+      "  --async-commit\t\tCopy damage off the main thread\n"
+      "  --shm-import\t\t\tShare shm buffers with the host without copying\n"
+      "\tOnly pools backed by memfds sealed with F_SEAL_SHRINK are shared\n"
+      "  --buffer-pool-size=BYTES\tMemory kept for reusing output buffers\n"
+      "  --buffer-size-bucket=PX\tRound output buffer sizes up to PX\n"
+      "  --buffer-queue-depth=N|adaptive\n"
+      "\tOutput buffers kept per surface\n"
+      "  --idle-trim-timeout=MS\tFree buffers of surfaces idle for MS\n"
+      "  --client-memory-limit=BYTES\tOutput buffer memory per client\n"
+      "  --memory-pressure-stall=US\tFree buffers when memory stalls for US\n"
+      "  --memory-pressure-window=US\tWindow the stall time is measured over\n"
+      "  --memory-pressure-file=PATH\tPSI file to monitor\n"
+      "  --memory-pressure-queue-depth=N\n"
+      "\tOutput buffers kept per surface under memory pressure\n"
+      "  --memory-pressure-hold=MS\tTime fewer buffers are kept for\n"
+      "  --tile-hash-damage\t\tDrop damage whose contents did not change\n"
+      "  --prefault-buffers\t\tFault in shm output buffers up front\n"
+      "  --no-async-fence-wait\t\tBlock until client GPU rendering is done\n"
+      "  --stats\t\t\tDump statistics on SIGUSR1\n"
 #ifdef PERFETTO_TRACING
       "  --trace-filename=PATH\t\tPath to Perfetto trace filename\n"
       "  --trace-system\t\tPerfetto trace to system daemon\n"
@@ -3708,6 +3815,46 @@ int real_main(int argc, char** argv) {
       client_fd = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--direct-scale") == arg) {
       ctx.use_direct_scale = true;
+    } else if (strstr(arg, "--copy-threads") == arg) {
+      ctx.copy_threads = MAX(0, atoi(sl_arg_value(arg)));
+    } else if (strstr(arg, "--copy-parallel-threshold") == arg) {
+      ctx.copy_parallel_threshold = strtoul(sl_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--async-commit") == arg) {
+      ctx.async_commit = true;
+    } else if (strstr(arg, "--shm-import") == arg) {
+      ctx.shm_import = true;
+    } else if (strstr(arg, "--buffer-pool-size") == arg) {
+      ctx.buffer_pool_size = strtoul(sl_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--buffer-size-bucket") == arg) {
+      ctx.buffer_size_bucket = MAX(0, atoi(sl_arg_value(arg)));
+    } else if (strstr(arg, "--idle-trim-timeout") == arg) {
+      ctx.idle_trim_timeout_ms = MAX(0, atoi(sl_arg_value(arg)));
+    } else if (strstr(arg, "--client-memory-limit") == arg) {
+      ctx.client_memory_limit = strtoul(sl_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--memory-pressure-stall") == arg) {
+      ctx.memory_pressure_stall_us = strtoul(sl_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--memory-pressure-window") == arg) {
+      ctx.memory_pressure_window_us = strtoul(sl_arg_value(arg), NULL, 10);
+    } else if (strstr(arg, "--memory-pressure-file") == arg) {
+      ctx.memory_pressure_file = sl_arg_value(arg);
+    } else if (strstr(arg, "--memory-pressure-queue-depth") == arg) {
+      ctx.memory_pressure_queue_depth = MAX(1, atoi(sl_arg_value(arg)));
+    } else if (strstr(arg, "--memory-pressure-hold") == arg) {
+      ctx.memory_pressure_hold_ms = MAX(1, atoi(sl_arg_value(arg)));
+    } else if (strstr(arg, "--buffer-queue-depth") == arg) {
+      const char* depth = sl_arg_value(arg);
+      if (strcmp(depth, "adaptive") == 0)
+        ctx.buffer_queue_adaptive = true;
+      else
+        ctx.buffer_queue_depth = MAX(0, atoi(depth));
+    } else if (strstr(arg, "--tile-hash-damage") == arg) {
+      ctx.tile_hash_damage = true;
+    } else if (strstr(arg, "--prefault-buffers") == arg) {
+      ctx.prefault_buffers = true;
+    } else if (strstr(arg, "--no-async-fence-wait") == arg) {
+      ctx.async_fence_wait = false;
+    } else if (strstr(arg, "--stats") == arg) {
+      ctx.stats = true;
     } else if (strstr(arg, "--scale") == arg) {
       scale = sl_arg_value(arg);
     } else if (strstr(arg, "--dpi") == arg) {
@@ -3900,6 +4047,13 @@ int real_main(int argc, char** argv) {
     }
 
     ctx.drm_device = drm_device;
+
+    // GEM handles are per open file, so a separate one keeps the handles of
+    // DRM PRIME buffers apart from those GBM creates and closes.
+    ctx.drm_resource_fd = open(drm_device, O_RDWR | O_CLOEXEC);
+    if (ctx.drm_resource_fd == -1)
+      fprintf(stderr, "warning: could not reopen %s (%s)\n", drm_device,
+              strerror(errno));
   }
 
   wl_array_init(&ctx.dpi);
@@ -3996,12 +4150,15 @@ int real_main(int argc, char** argv) {
     enable_tracing(!ctx.trace_system);
   }
 
-  // Trigger trace and timing log dumps when USR1 signals are received
-  if (tracing_needed || ctx.timing) {
+  // Trigger trace, timing log and stats dumps when USR1 signals are received
+  if (tracing_needed || ctx.timing || ctx.stats) {
     ctx.sigusr1_event_source.reset(
         wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx));
   }
 
+  if (ctx.memory_pressure_stall_us)
+    sl_memory_pressure_init(&ctx, event_loop);
+
   // Initialize timing log values.
   if (ctx.timing) {
     ctx.timing->RecordStartTime();
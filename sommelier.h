@@ -38,6 +38,8 @@ struct sl_data_source;
 struct sl_xdg_shell;
 struct sl_subcompositor;
 struct sl_aura_shell;
+struct sl_copy_tile_hashes;
+struct sl_drm_resource;
 struct sl_viewporter;
 struct sl_linux_dmabuf;
 struct sl_keyboard_extension;
@@ -149,6 +151,13 @@ struct sl_host_surface {
   struct sl_mmap* contents_shm_mmap;
   bool contents_shaped;
   pixman_region32_t contents_shape;
+  // True if the output buffer is larger than the contents (see
+  // --buffer-size-bucket), and the host has to be shown only the top-left
+  // part of it.
+  bool contents_cropped;
+  // True if the host viewport source was last set by us to crop the output
+  // buffer, rather than by the client.
+  bool viewport_cropped;
   int has_role;
   int has_output;
   int has_own_scale;
@@ -156,9 +165,57 @@ struct sl_host_surface {
   int32_t cached_logical_height;
   uint32_t last_event_serial;
   struct sl_output_buffer* current_buffer;
+  // Set if current_buffer was attached to the host surface since the last
+  // commit forwarded to the host.
+  bool current_buffer_attached;
   struct zwp_linux_surface_synchronization_v1* surface_sync;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  // Link in sl_context::host_surfaces.
+  struct wl_list link;
+  // Bytes of output buffers held for this surface, including shape images.
+  size_t memory_bytes;
+  // Damage copy counters for the most recent commit: rectangles of surface
+  // and buffer damage received, spans actually copied after merging, and
+  // total bytes written to the output buffer.
+  uint32_t damage_rects_in;
+  uint32_t damage_rects_out;
+  uint64_t damage_bytes_copied;
+  // Number of commits of this surface not yet forwarded to the host.
+  int pending_commits;
+  // Maximum number of output buffers kept, 0 for no limit (see
+  // --buffer-queue-depth). Buffers the host holds on to are never dropped,
+  // so this only limits how many released buffers are kept around.
+  int buffer_queue_depth;
+  // Moving averages of the time from commit to release of output buffers,
+  // and between commits, in nanoseconds. Drive the adaptive queue depth.
+  uint64_t release_latency_ns;
+  uint64_t commit_interval_ns;
+  uint64_t last_commit_ns;
+  // With --tile-hash-damage, damage is held back until commit, when tiles
+  // whose contents did not change are dropped from it. Surface damage is in
+  // surface coordinates, buffer damage in buffer coordinates.
+  pixman_region32_t deferred_surface_damage;
+  pixman_region32_t deferred_buffer_damage;
+  // Hashes of the contents last shown by the host, allocated on first use.
+  struct sl_copy_tile_hashes* tile_hashes;
+  // Damaged pixels in buffer coordinates before and after dropping
+  // unchanged tiles, for the most recent commit.
+  uint64_t tile_damage_pixels_in;
+  uint64_t tile_damage_pixels_out;
+  // Sync file that signals once the GPU has finished rendering the attached
+  // buffer, or -1 if there is nothing to wait for. The next commit is held
+  // back until then, if acquire_fence_commit is set.
+  int acquire_fence_fd;
+  std::unique_ptr<struct wl_event_source> acquire_fence_source;
+  bool acquire_fence_commit;
+  // Time the last acquire fence was exported, and how long the client's GPU
+  // took to signal it after that.
+  uint64_t acquire_fence_start_ns;
+  uint64_t acquire_fence_wait_ns;
+  // How long the host's GPU kept reading the last output buffer it released
+  // with a fence that was still pending.
+  uint64_t release_fence_wait_ns;
 };
 MAP_STRUCTS(wl_surface, sl_host_surface);
 
@@ -385,6 +442,8 @@ typedef void (*sl_sync_func_t)(struct sl_context* ctx,
 struct sl_sync_point {
   int fd;
   sl_sync_func_t sync;
+  // Reference to the GEM handle of `fd`, for DRM PRIME buffers.
+  struct sl_drm_resource* drm_resource;
 };
 
 #ifdef GAMEPAD_SUPPORT
@@ -412,6 +471,24 @@ void sl_compositor_init_context(struct sl_context* ctx,
                                 uint32_t id,
                                 uint32_t version);
 
+// Forwards any commits of `host` that are still waiting for their damage
+// copy, blocking until the copy has completed. Must be called before sending
+// anything to the host that applies to the surface's pending state.
+void sl_host_surface_flush(struct sl_host_surface* host);
+
+// Forwards the pending state of `host` to the host with wl_surface_commit,
+// asking for an explicit release of the output buffer attached with it, if
+// any.
+void sl_host_surface_commit_to_host(struct sl_host_surface* host);
+
+// Frees every output buffer that is neither held by the host nor about to be
+// committed, including the context's pool. Returns the number of bytes freed.
+size_t sl_compositor_release_buffers(struct sl_context* ctx);
+
+// Writes the output buffer memory held for each client and surface to
+// `stream`.
+void sl_compositor_dump_memory(struct sl_context* ctx, FILE* stream);
+
 size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
@@ -443,6 +520,13 @@ struct sl_global* sl_gtk_shell_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_drm_global_create(struct sl_context* ctx);
 
+// Returns a reference to the GEM handle of the DRM PRIME buffer `fd`,
+// importing it only if no other reference to the same buffer exists.
+// Returns NULL if the buffer cannot be imported.
+struct sl_drm_resource* sl_drm_resource_get(struct sl_context* ctx, int fd);
+struct sl_drm_resource* sl_drm_resource_ref(struct sl_drm_resource* resource);
+void sl_drm_resource_unref(struct sl_drm_resource* resource);
+
 struct sl_global* sl_text_input_extension_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_text_input_manager_global_create(struct sl_context* ctx);
@@ -3,19 +3,29 @@
 // found in the LICENSE file.
 
 #include <ctype.h>
+#include <errno.h>
 #include <iostream>
+#include <set>
 #include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
 
-#include "sommelier.h"  // NOLINT(build/include_directory)
+#include "sommelier.h"       // NOLINT(build/include_directory)
+#include "sommelier-copy.h"   // NOLINT(build/include_directory)
+#include "sommelier-stats.h"  // NOLINT(build/include_directory)
 #include "virtualization/wayland_channel.h"  // NOLINT(build/include_directory)
 
 #include "aura-shell-client-protocol.h"      // NOLINT(build/include_directory)
+#include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
+#include "linux-explicit-synchronization-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
 #include "xdg-shell-client-protocol.h"       // NOLINT(build/include_directory)
 
 // Help gtest print Wayland message streams on expectation failure.
@@ -65,6 +75,7 @@ namespace sommelier {
 using ::testing::_;
 using ::testing::AllOf;
 using ::testing::DoAll;
+using ::testing::Invoke;
 using ::testing::NiceMock;
 using ::testing::PrintToString;
 using ::testing::Return;
@@ -89,6 +100,7 @@ class MockWaylandChannel : public WaylandChannel {
       (enum WaylandChannelEvent & event_type,  // NOLINT(runtime/references)
        struct WaylandSendReceive& receive,     // NOLINT(runtime/references)
        int& out_read_pipe));                   // NOLINT(runtime/references)
+  MOCK_METHOD(int32_t, release_receive, ());
 
   MOCK_METHOD(int32_t,
               allocate,
@@ -96,12 +108,20 @@ class MockWaylandChannel : public WaylandChannel {
                struct WaylandBufferCreateOutput&
                    create_output));  // NOLINT(runtime/references)
   MOCK_METHOD(int32_t, sync, (int dmabuf_fd, uint64_t flags));
+  MOCK_METHOD(bool, supports_shm_import, ());
+  MOCK_METHOD(int32_t,
+              import_shm,
+              (const struct WaylandShmImportInfo& import_info,
+               struct WaylandBufferCreateOutput&
+                   import_output));  // NOLINT(runtime/references)
   MOCK_METHOD(int32_t,
               handle_pipe,
               (int read_fd,
                bool readable,
                bool& hang_up));  // NOLINT(runtime/references)
   MOCK_METHOD(size_t, max_send_size, ());
+  MOCK_METHOD(uint8_t*, send_buffer, ());
+  MOCK_METHOD(size_t, release_caches, ());
 
  protected:
   ~MockWaylandChannel() override {}
@@ -606,6 +626,917 @@ TEST_F(X11Test, IconifySuppressesStateChanges) {
 }
 #endif
 
+// Fixture for tests of how the messages a client writes to the virtwl socket
+// are batched into channel submissions.
+class VirtwlSocketTest : public WaylandTest {
+ public:
+  void SetUp() override {
+    WaylandTest::SetUp();
+    // Flush out init messages not relevant to the tests.
+    Pump();
+    ON_CALL(mock_wayland_channel_, send(_))
+        .WillByDefault(Invoke([this](const struct WaylandSendReceive& send) {
+          sends_.emplace_back(reinterpret_cast<char*>(send.data),
+                              send.data_size);
+          send_fds_.push_back(send.num_fds);
+          return 0;
+        }));
+  }
+
+ protected:
+  // Write `data` to the client end of the virtwl socket as one message,
+  // along with a new FD if `with_fd` is set.
+  void Write(const std::string& data, bool with_fd) {
+    struct iovec iov = {const_cast<char*>(data.data()), data.size()};
+    int fd = with_fd ? eventfd(0, EFD_CLOEXEC) : -1;
+    char control[CMSG_SPACE(sizeof(fd))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (with_fd) {
+      ASSERT_GE(fd, 0);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+    ssize_t written = sendmsg(ctx.virtwl_display_fd, &msg, 0);
+
+    ASSERT_EQ(written, static_cast<ssize_t>(data.size()));
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Let Sommelier handle what was written to the socket.
+  void Dispatch() {
+    wl_event_loop_dispatch(wl_display_get_event_loop(ctx.host_display), 0);
+  }
+
+  // Data and number of FDs of each submission to the channel, in order.
+  std::vector<std::string> sends_;
+  std::vector<uint32_t> send_fds_;
+};
+
+TEST_F(VirtwlSocketTest, MergesReadsIntoOneSend) {
+  uint64_t reads = sl_stats_get(SL_STAT_CHANNEL_SOCKET_READS);
+
+  // Arrange: A message with an FD ends a read, so the socket is read twice.
+  Write("first message", true);
+  Write("second message", false);
+
+  Dispatch();
+
+  // Assert: Both reads are submitted together.
+  EXPECT_EQ(sl_stats_get(SL_STAT_CHANNEL_SOCKET_READS), reads + 2);
+  ASSERT_EQ(sends_.size(), 1u);
+  EXPECT_EQ(sends_[0], "first messagesecond message");
+  EXPECT_EQ(send_fds_[0], 1u);
+}
+
+TEST_F(VirtwlSocketTest, SplitsFdsOfTwoReadsIntoTwoSends) {
+  Write("first message", true);
+  Write("second message", true);
+
+  Dispatch();
+
+  // Assert: FDs of different reads are never submitted together, and the
+  // bytes keep their order.
+  ASSERT_EQ(sends_.size(), 2u);
+  EXPECT_EQ(sends_[0], "first message");
+  EXPECT_EQ(send_fds_[0], 1u);
+  EXPECT_EQ(sends_[1], "second message");
+  EXPECT_EQ(send_fds_[1], 1u);
+}
+
+TEST_F(VirtwlSocketTest, FlushesWhenMaxSendSizeIsReached) {
+  ON_CALL(mock_wayland_channel_, max_send_size()).WillByDefault(Return(16));
+  Write("0123456789abcdefghijklmn", false);
+
+  Dispatch();
+
+  // Assert: A full submission is sent before the rest is read.
+  ASSERT_EQ(sends_.size(), 2u);
+  EXPECT_EQ(sends_[0], "0123456789abcdef");
+  EXPECT_EQ(sends_[1], "ghijklmn");
+  EXPECT_EQ(send_fds_[0] + send_fds_[1], 0u);
+}
+
+// Fixture for tests which attach shm buffers from a client, which Sommelier
+// copies into output buffers it allocates through the channel.
+class OutputBufferTest : public WaylandTest {
+ public:
+  void SetUp() override {
+    ON_CALL(mock_wayland_channel_, allocate(_, _))
+        .WillByDefault(Invoke(AllocateMemfd));
+    ON_CALL(mock_wayland_channel_, send(_))
+        .WillByDefault(Invoke([this](const struct WaylandSendReceive& send) {
+          RecordHostObjects(send);
+          return 0;
+        }));
+    WaylandTest::SetUp();
+  }
+
+  void TearDown() override {
+    WaylandTest::TearDown();
+    if (client_display_)
+      wl_display_disconnect(client_display_);
+  }
+
+ protected:
+  static constexpr int32_t kWidth = 64;
+  static constexpr int32_t kHeight = 64;
+  static constexpr size_t kBufferSize = kWidth * kHeight * 4;
+
+  void Connect() override {
+    WaylandTest::Connect();
+    host_registry_ = wl_display_get_registry(ctx.display);
+    AddHostGlobals();
+    ConnectClient();
+  }
+
+  // Fake the host advertising the globals output buffers are created with.
+  virtual void AddHostGlobals() {
+    sl_registry_handler(&ctx, host_registry_, 3, "wl_shm", 1);
+  }
+
+  // Backs output buffers with memfds, as if they were host memory.
+  static int32_t AllocateMemfd(
+      const struct WaylandBufferCreateInfo& create_info,
+      struct WaylandBufferCreateOutput&
+          create_output) {  // NOLINT(runtime/references)
+    uint32_t stride = create_info.dmabuf ? create_info.width * 4 : 0;
+    size_t size =
+        create_info.dmabuf ? stride * create_info.height : create_info.size;
+
+    create_output.fd = memfd_create("output-buffer", MFD_CLOEXEC);
+    if (create_output.fd < 0 || ftruncate(create_output.fd, size))
+      return -errno;
+    create_output.strides[0] = stride;
+    create_output.host_size = size;
+    return 0;
+  }
+
+  // Connect a client to Sommelier, bound to its compositor and shm globals.
+  void ConnectClient() {
+    int sv[2];
+    int rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    ASSERT_EQ(rv, 0);
+
+    ctx.client = wl_client_create(ctx.host_display, sv[0]);
+    sl_set_display_implementation(&ctx, ctx.client);
+    client_display_ = wl_display_connect_to_fd(sv[1]);
+    ASSERT_NE(client_display_, nullptr);
+
+    // Globals are bound by name without waiting for the registry's events,
+    // which nothing here dispatches.
+    wl_registry* registry = wl_display_get_registry(client_display_);
+    compositor_ = static_cast<wl_compositor*>(wl_registry_bind(
+        registry, ctx.compositor->host_global->name, &wl_compositor_interface,
+        ctx.compositor->host_global->version));
+    shm_ = static_cast<wl_shm*>(wl_registry_bind(
+        registry, ctx.shm->host_global->name, &wl_shm_interface, 1));
+    PumpClient();
+  }
+
+  // Dispatch the client's requests to Sommelier, then forward what Sommelier
+  // sent in response to the mock host.
+  void PumpClient() {
+    wl_display_flush(client_display_);
+    wl_event_loop_dispatch(wl_display_get_event_loop(ctx.host_display), 0);
+    Pump();
+  }
+
+  // Create a client surface. It is given a role, so that its commits are
+  // forwarded to the host.
+  wl_surface* CreateSurface() {
+    wl_surface* surface = wl_compositor_create_surface(compositor_);
+    PumpClient();
+    HostSurface(surface)->has_role = 1;
+    return surface;
+  }
+
+  sl_host_surface* HostSurface(wl_surface* surface) {
+    wl_resource* resource = wl_client_get_object(
+        ctx.client, wl_proxy_get_id(reinterpret_cast<wl_proxy*>(surface)));
+    EXPECT_NE(resource, nullptr);
+    return static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+  }
+
+  wl_buffer* CreateBuffer(int32_t width, int32_t height) {
+    int32_t size = width * height * 4;
+    int fd = memfd_create("client-buffer", MFD_CLOEXEC);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(ftruncate(fd, size), 0);
+
+    wl_shm_pool* pool = wl_shm_create_pool(shm_, fd, size);
+    wl_buffer* buffer = wl_shm_pool_create_buffer(
+        pool, 0, width, height, width * 4, WL_SHM_FORMAT_XRGB8888);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    return buffer;
+  }
+
+  void AttachAndCommit(wl_surface* surface, wl_buffer* buffer) {
+    wl_surface_attach(surface, buffer, 0, 0);
+    wl_surface_damage(surface, 0, 0, kWidth, kHeight);
+    wl_surface_commit(surface);
+    PumpClient();
+  }
+
+  // Send an event without arguments from the host to Sommelier, and dispatch
+  // it.
+  void SendHostEvent(uint32_t object_id, uint16_t opcode) {
+    uint32_t message[2] = {object_id, 0};
+    message[1] = static_cast<uint32_t>(sizeof(message) << 16) | opcode;
+    ssize_t written = write(ctx.virtwl_socket_fd, message, sizeof(message));
+
+    ASSERT_EQ(written, static_cast<ssize_t>(sizeof(message)));
+    wl_display_dispatch(ctx.display);
+  }
+
+  // Follow the requests Sommelier sends to the host, to learn the IDs of the
+  // host objects it creates for output buffers.
+  void RecordHostObjects(const struct WaylandSendReceive& send) {
+    uint32_t shm_id = ProxyId(ctx.shm ? ctx.shm->internal : nullptr);
+    uint32_t dmabuf_id =
+        ProxyId(ctx.linux_dmabuf ? ctx.linux_dmabuf->internal : nullptr);
+    size_t i = 0;
+
+    while (i + sizeof(uint32_t) * 3 <= send.data_size) {
+      const uint32_t* words = reinterpret_cast<uint32_t*>(send.data + i);
+      uint32_t object_id = words[0];
+      uint16_t size = words[1] >> 16;
+      uint16_t opcode = words[1] & 0xffff;
+      // Every request followed here has the new object's ID as its first
+      // argument.
+      uint32_t new_id = words[2];
+
+      if (size < sizeof(uint32_t) * 2)
+        break;
+      if (object_id == shm_id && opcode == WL_SHM_CREATE_POOL) {
+        host_pools_.insert(new_id);
+      } else if (object_id == dmabuf_id &&
+                 opcode == ZWP_LINUX_DMABUF_V1_CREATE_PARAMS) {
+        host_params_.insert(new_id);
+      } else if ((host_pools_.count(object_id) &&
+                  opcode == WL_SHM_POOL_CREATE_BUFFER) ||
+                 (host_params_.count(object_id) &&
+                  opcode == ZWP_LINUX_BUFFER_PARAMS_V1_CREATE_IMMED)) {
+        host_buffers_.push_back(new_id);
+      } else if (IsHostSurfaceSync(object_id) &&
+                 opcode == ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_GET_RELEASE) {
+        host_releases_.push_back(new_id);
+      }
+      i += size;
+    }
+  }
+
+  static uint32_t ProxyId(void* proxy) {
+    return proxy ? wl_proxy_get_id(static_cast<wl_proxy*>(proxy)) : 0;
+  }
+
+  bool IsHostSurfaceSync(uint32_t object_id) {
+    sl_host_surface* host;
+
+    wl_list_for_each(host, &ctx.host_surfaces, link) {
+      if (ProxyId(host->surface_sync) == object_id)
+        return true;
+    }
+    return false;
+  }
+
+  wl_registry* host_registry_ = nullptr;
+  wl_display* client_display_ = nullptr;
+  wl_compositor* compositor_ = nullptr;
+  wl_shm* shm_ = nullptr;
+  std::set<uint32_t> host_pools_;
+  std::set<uint32_t> host_params_;
+  // Host wl_buffers of output buffers, and their explicit releases, in the
+  // order they were created.
+  std::vector<uint32_t> host_buffers_;
+  std::vector<uint32_t> host_releases_;
+};
+
+// Fixture for tests whose output buffers are dma-bufs the host releases
+// through zwp_linux_explicit_synchronization_v1.
+class ExplicitSyncOutputBufferTest : public OutputBufferTest {
+ public:
+  void SetUp() override {
+    ON_CALL(mock_wayland_channel_, supports_dmabuf())
+        .WillByDefault(Return(true));
+    OutputBufferTest::SetUp();
+  }
+
+ protected:
+  void InitContext() override {
+    OutputBufferTest::InitContext();
+    ctx.use_explicit_fence = true;
+  }
+
+  void AddHostGlobals() override {
+    OutputBufferTest::AddHostGlobals();
+    sl_registry_handler(&ctx, host_registry_, 4, "zwp_linux_dmabuf_v1", 2);
+    sl_registry_handler(&ctx, host_registry_, 5,
+                        "zwp_linux_explicit_synchronization_v1", 1);
+  }
+
+  // Send an event whose only argument is `fd` from the host to Sommelier,
+  // and dispatch it.
+  void SendHostFdEvent(uint32_t object_id, uint16_t opcode, int fd) {
+    uint32_t message[2] = {object_id, 0};
+    message[1] = static_cast<uint32_t>(sizeof(message) << 16) | opcode;
+    struct iovec iov = {message, sizeof(message)};
+    char control[CMSG_SPACE(sizeof(fd))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    ssize_t written = sendmsg(ctx.virtwl_socket_fd, &msg, 0);
+
+    ASSERT_EQ(written, static_cast<ssize_t>(sizeof(message)));
+    wl_display_dispatch(ctx.display);
+  }
+};
+
+namespace {
+// Opcodes of zwp_linux_buffer_release_v1.fenced_release and
+// immediate_release. Only the client side of the protocol is generated for
+// Sommelier.
+constexpr uint16_t kFencedReleaseOpcode = 0;
+constexpr uint16_t kImmediateReleaseOpcode = 1;
+}  // namespace
+
+TEST_F(OutputBufferTest, ReusesOutputBufferReleasedByHost) {
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  uint64_t allocations = sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS);
+
+  AttachAndCommit(surface, buffer);
+  ASSERT_EQ(host_buffers_.size(), 1u);
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 1);
+  EXPECT_EQ(host->memory_bytes, kBufferSize);
+
+  // Act: The host releases the output buffer before the next commit.
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 0);
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 1);
+  AttachAndCommit(surface, buffer);
+
+  // Assert: The next commit copies into the same buffer.
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS), allocations + 1);
+  EXPECT_EQ(host_buffers_.size(), 1u);
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 1);
+}
+
+TEST_F(OutputBufferTest, PoolsReleasedBuffersBeyondQueueDepth) {
+  ctx.buffer_queue_depth = 1;
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  uint64_t allocations = sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS);
+  uint64_t hits = sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS);
+
+  // Arrange: Two commits before the host releases anything need two buffers.
+  AttachAndCommit(surface, buffer);
+  AttachAndCommit(surface, buffer);
+  ASSERT_EQ(host_buffers_.size(), 2u);
+  EXPECT_EQ(host->memory_bytes, 2 * kBufferSize);
+
+  // Act: The host releases the first one, which the surface does not keep.
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+
+  // Assert: It is handed over to the pool.
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 0);
+  EXPECT_EQ(host->memory_bytes, kBufferSize);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, kBufferSize);
+
+  // Act: Another surface commits contents of the same size.
+  wl_surface* other = CreateSurface();
+  AttachAndCommit(other, buffer);
+
+  // Assert: It takes the pooled buffer instead of allocating one.
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS), allocations + 2);
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS), hits + 1);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, 0u);
+  EXPECT_EQ(HostSurface(other)->memory_bytes, kBufferSize);
+}
+
+TEST_F(OutputBufferTest, PoolEvictsOldestBuffersOverBufferPoolSize) {
+  ctx.buffer_pool_size = kBufferSize;
+  wl_surface* surface = CreateSurface();
+  wl_buffer* large = CreateBuffer(kWidth, kHeight);
+  wl_buffer* small = CreateBuffer(kWidth / 2, kHeight / 2);
+  wl_buffer* medium = CreateBuffer(kWidth * 3 / 4, kHeight * 3 / 4);
+  uint64_t evictions = sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_EVICTIONS);
+  uint64_t hits = sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS);
+
+  // Arrange: Resizing the surface puts its released buffer into the pool,
+  // filling it.
+  AttachAndCommit(surface, large);
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+  AttachAndCommit(surface, small);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, kBufferSize);
+  SendHostEvent(host_buffers_[1], WL_BUFFER_RELEASE);
+
+  // Act: Resize again, pooling the small buffer too.
+  AttachAndCommit(surface, medium);
+
+  // Assert: The large buffer, pooled first, is evicted to make room.
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_EVICTIONS), evictions + 1);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, kBufferSize / 4);
+
+  // Assert: The small buffer is still there for another surface.
+  wl_surface* other = CreateSurface();
+  AttachAndCommit(other, small);
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS), hits + 1);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, 0u);
+}
+
+TEST_F(OutputBufferTest, ClientMemoryLimitFreesReleasedBuffersOnAttach) {
+  ctx.client_memory_limit = 2 * kBufferSize;
+  wl_surface* first = CreateSurface();
+  wl_surface* second = CreateSurface();
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  uint64_t freed = sl_stats_get(SL_STAT_MEMORY_LIMIT_BYTES);
+
+  // Arrange: The first surface holds two buffers, one of them released by
+  // the host. That is all the client may hold.
+  AttachAndCommit(first, buffer);
+  AttachAndCommit(first, buffer);
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+  EXPECT_EQ(wl_list_length(&HostSurface(first)->released_buffers), 1);
+  EXPECT_EQ(HostSurface(first)->memory_bytes, 2 * kBufferSize);
+
+  // Act: The second surface needs a buffer of its own.
+  AttachAndCommit(second, buffer);
+
+  // Assert: The client went over its limit, so the released buffer of the
+  // first surface is freed rather than pooled.
+  EXPECT_EQ(sl_stats_get(SL_STAT_MEMORY_LIMIT_BYTES), freed + kBufferSize);
+  EXPECT_EQ(wl_list_length(&HostSurface(first)->released_buffers), 0);
+  EXPECT_EQ(HostSurface(first)->memory_bytes, kBufferSize);
+  EXPECT_EQ(HostSurface(second)->memory_bytes, kBufferSize);
+  EXPECT_EQ(ctx.output_buffer_pool_bytes, 0u);
+}
+
+TEST_F(ExplicitSyncOutputBufferTest, WaitsForExplicitReleaseOfDmabufs) {
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  ASSERT_NE(host->surface_sync, nullptr);
+
+  AttachAndCommit(surface, buffer);
+  ASSERT_EQ(host_buffers_.size(), 1u);
+  ASSERT_EQ(host_releases_.size(), 1u);
+
+  // Act: wl_buffer.release may refer to an earlier commit of the buffer.
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+
+  // Assert: It is ignored while an explicit release is pending.
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 1);
+
+  // Act: The explicit release arrives.
+  SendHostEvent(host_releases_[0], kImmediateReleaseOpcode);
+
+  // Assert: The buffer is released, and its next commit asks for another
+  // explicit release.
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 0);
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 1);
+  AttachAndCommit(surface, buffer);
+  EXPECT_EQ(host_buffers_.size(), 1u);
+  EXPECT_EQ(host_releases_.size(), 2u);
+}
+
+TEST_F(ExplicitSyncOutputBufferTest, WaitsForReleaseFenceOnEventLoop) {
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  // An eventfd polls readable once written to, like a signaled fence.
+  int fence = eventfd(0, EFD_CLOEXEC);
+  ASSERT_GE(fence, 0);
+
+  AttachAndCommit(surface, buffer);
+  ASSERT_EQ(host_releases_.size(), 1u);
+
+  // Act: The host releases the buffer while its GPU still reads it.
+  SendHostFdEvent(host_releases_[0], kFencedReleaseOpcode, fence);
+
+  // Assert: The buffer is not reused before the fence signals.
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 1);
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 0);
+
+  // Act: The fence signals.
+  ASSERT_EQ(eventfd_write(fence, 1), 0);
+  wl_event_loop_dispatch(wl_display_get_event_loop(ctx.host_display), 0);
+
+  // Assert: The buffer is released without any commit waiting for it.
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 0);
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 1);
+  close(fence);
+}
+
+TEST_F(ExplicitSyncOutputBufferTest, ShmOutputBuffersUseImplicitRelease) {
+  // Arrange: The channel cannot allocate dma-bufs, so output buffers are shm
+  // even though the surface has explicit sync.
+  ON_CALL(mock_wayland_channel_, supports_dmabuf())
+      .WillByDefault(Return(false));
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* buffer = CreateBuffer(kWidth, kHeight);
+  ASSERT_NE(host->surface_sync, nullptr);
+
+  AttachAndCommit(surface, buffer);
+  ASSERT_EQ(host_buffers_.size(), 1u);
+
+  // Assert: No explicit release is requested, and wl_buffer.release frees up
+  // the buffer.
+  EXPECT_EQ(host_releases_.size(), 0u);
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+  EXPECT_EQ(wl_list_length(&host->busy_buffers), 0);
+  EXPECT_EQ(wl_list_length(&host->released_buffers), 1);
+}
+
+// Fixture for tests whose dma-buf output buffers are rounded up to
+// --buffer-size-bucket and cropped through the viewport.
+class BucketedOutputBufferTest : public OutputBufferTest {
+ public:
+  void SetUp() override {
+    ON_CALL(mock_wayland_channel_, supports_dmabuf())
+        .WillByDefault(Return(true));
+    OutputBufferTest::SetUp();
+  }
+
+ protected:
+  void InitContext() override {
+    OutputBufferTest::InitContext();
+    ctx.buffer_size_bucket = kWidth;
+  }
+
+  void AddHostGlobals() override {
+    OutputBufferTest::AddHostGlobals();
+    sl_registry_handler(&ctx, host_registry_, 4, "zwp_linux_dmabuf_v1", 2);
+    sl_registry_handler(&ctx, host_registry_, 5, "wp_viewporter", 1);
+  }
+};
+
+TEST_F(BucketedOutputBufferTest, CopiesAllContentsWhenSizeChangesInBucket) {
+  wl_surface* surface = CreateSurface();
+  sl_host_surface* host = HostSurface(surface);
+  wl_buffer* small = CreateBuffer(kWidth / 2, kHeight / 2);
+  wl_buffer* large = CreateBuffer(kWidth * 3 / 4, kHeight * 3 / 4);
+  uint64_t allocations = sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS);
+
+  // Arrange: The output buffer was filled with smaller contents, and the
+  // host is done with it.
+  AttachAndCommit(surface, small);
+  ASSERT_EQ(host_buffers_.size(), 1u);
+  SendHostEvent(host_buffers_[0], WL_BUFFER_RELEASE);
+
+  // Act: Larger contents in the same bucket, of which the client damages
+  // only a corner.
+  wl_surface_attach(surface, large, 0, 0);
+  wl_surface_damage(surface, 0, 0, 1, 1);
+  wl_surface_commit(surface);
+  PumpClient();
+
+  // Assert: The buffer is reused, and all of the contents are copied as the
+  // part they grew into holds stale pixels.
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_ALLOCATIONS), allocations + 1);
+  EXPECT_EQ(host_buffers_.size(), 1u);
+  EXPECT_EQ(host->damage_bytes_copied,
+            static_cast<uint64_t>(kWidth * 3 / 4 * kHeight * 3 / 4 * 4));
+}
+
+TEST(CopyTest, AllKernelsMatchMemcpy) {
+  size_t num_kernels;
+  const sl_copy_kernel* const* kernels =
+      sl_copy_supported_kernels(&num_kernels);
+  ASSERT_GE(num_kernels, 1u);
+
+  // Cover the memcpy() fallback for short rows, the vector loops and the
+  // unaligned head and tail handling.
+  const size_t row_bytes[] = {1, 17, 255, 256, 257, 1000, 7680};
+  const size_t misalignments[] = {0, 1, 31, 63};
+  const size_t rows = 5;
+
+  for (size_t k = 0; k < num_kernels; ++k) {
+    for (size_t bytes : row_bytes) {
+      for (size_t misalign : misalignments) {
+        size_t src_stride = bytes + 3;
+        size_t dst_stride = bytes + 128;
+        std::vector<uint8_t> src(src_stride * rows + misalign);
+        std::vector<uint8_t> expected(dst_stride * rows + misalign, 0xcc);
+        std::vector<uint8_t> actual(expected);
+        for (size_t i = 0; i < src.size(); ++i)
+          src[i] = static_cast<uint8_t>(i * 7 + 1);
+
+        for (size_t row = 0; row < rows; ++row) {
+          memcpy(expected.data() + misalign + row * dst_stride,
+                 src.data() + misalign + row * src_stride, bytes);
+        }
+        kernels[k]->copy_rows(actual.data() + misalign, dst_stride,
+                              src.data() + misalign, src_stride, bytes, rows);
+
+        EXPECT_EQ(actual, expected)
+            << kernels[k]->name << " bytes=" << bytes
+            << " misalign=" << misalign;
+      }
+    }
+  }
+}
+
+TEST(CopyTest, PlannerMergesNearbyRectsAndKeepsDistantOnesApart) {
+  sl_copy_job job = {};
+  job.bpp = 4;
+  job.num_planes = 1;
+  job.y_ss[0] = 1;
+  job.width = 1920;
+  job.height = 1080;
+  job.src_stride[0] = 1920 * 4;
+  job.dst_stride[0] = 1920 * 4 + 256;
+  std::vector<sl_copy_span> spans;
+  pixman_region32_t damage;
+  pixman_region32_init(&damage);
+
+  // Two glyph-sized rects next to each other are cheaper as one span.
+  pixman_region32_union_rect(&damage, &damage, 100, 100, 8, 16);
+  pixman_region32_union_rect(&damage, &damage, 110, 100, 8, 16);
+  // A rect at the far corner is not worth merging with them.
+  pixman_region32_union_rect(&damage, &damage, 1800, 1000, 8, 16);
+  sl_copy_plan(&job, &damage, &spans);
+
+  ASSERT_EQ(spans.size(), 2u);
+  EXPECT_EQ(spans[0].x, 100);
+  EXPECT_EQ(spans[0].width, 18);
+  EXPECT_EQ(spans[1].x, 1800);
+  EXPECT_FALSE(spans[0].contiguous);
+
+  pixman_region32_fini(&damage);
+}
+
+TEST(CopyTest, PlannerCopiesFullRowsAsOneBlockWhenStridesMatch) {
+  const int32_t width = 64, height = 8;
+  const size_t stride = width * 4 + 32;
+  std::vector<uint8_t> src(stride * height);
+  std::vector<uint8_t> dst(stride * height);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<uint8_t>(i);
+
+  size_t num_kernels;
+  sl_copy_job job = {};
+  job.kernel = sl_copy_supported_kernels(&num_kernels)[0];
+  job.src_addr = src.data();
+  job.dst_addr = dst.data();
+  job.src_stride[0] = job.dst_stride[0] = stride;
+  job.bpp = 4;
+  job.num_planes = 1;
+  job.y_ss[0] = 1;
+  job.width = width;
+  job.height = height;
+  std::vector<sl_copy_span> spans;
+  pixman_region32_t damage;
+  pixman_region32_init_rect(&damage, 0, 2, width, 4);
+
+  sl_copy_plan(&job, &damage, &spans);
+  ASSERT_EQ(spans.size(), 1u);
+  EXPECT_TRUE(spans[0].contiguous);
+  EXPECT_EQ(sl_copy_span_execute(&job, &spans[0]), 3 * stride + width * 4);
+
+  for (int32_t y = 0; y < height; ++y) {
+    bool damaged = y >= 2 && y < 6;
+    EXPECT_EQ(memcmp(&src[y * stride], &dst[y * stride], width * 4) == 0,
+              damaged)
+        << "row " << y;
+  }
+
+  pixman_region32_fini(&damage);
+}
+
+TEST(CopyTest, PoolCopiesEveryPlaneRowExactlyOnce) {
+  // NV12-like layout: a full-height luma plane followed by a half-height
+  // chroma plane. The odd height makes bands straddle subsampled rows.
+  const int32_t width = 2048, height = 1023;
+  const size_t src_stride = width + 64, dst_stride = width + 128;
+  std::vector<uint8_t> src(src_stride * (height + height / 2));
+  std::vector<uint8_t> dst(dst_stride * (height + height / 2));
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<uint8_t>(i * 13 + 5);
+
+  size_t num_kernels;
+  sl_copy_job job = {};
+  job.kernel = sl_copy_supported_kernels(&num_kernels)[num_kernels - 1];
+  job.src_addr = src.data();
+  job.src_offset[1] = src_stride * height;
+  job.src_stride[0] = job.src_stride[1] = src_stride;
+  job.dst_addr = dst.data();
+  job.dst_offset[1] = dst_stride * height;
+  job.dst_stride[0] = job.dst_stride[1] = dst_stride;
+  job.bpp = 1;
+  job.num_planes = 2;
+  job.y_ss[0] = 1;
+  job.y_ss[1] = 2;
+  job.width = width;
+  job.height = height;
+  std::vector<sl_copy_span> spans = {{0, 0, width, height, false}};
+
+  sl_copy_pool* pool = sl_copy_pool_create(3);
+  EXPECT_EQ(sl_copy_pool_run(pool, &job, spans, 0),
+            static_cast<size_t>(width) * (height + height / 2));
+  sl_copy_pool_destroy(pool);
+
+  for (int32_t y = 0; y < height + height / 2; ++y) {
+    ASSERT_EQ(memcmp(&src[y * src_stride], &dst[y * dst_stride], width), 0)
+        << "row " << y;
+  }
+}
+
+TEST(CopyTest, QueueCompletesCopiesInSubmissionOrder) {
+  const int32_t width = 256, height = 64;
+  const size_t stride = width * 4;
+  std::vector<uint8_t> src(stride * height, 0x5a);
+  std::vector<uint8_t> dst_a(stride * height), dst_b(stride * height);
+
+  size_t num_kernels;
+  sl_copy_job job = {};
+  job.kernel = sl_copy_supported_kernels(&num_kernels)[0];
+  job.src_addr = src.data();
+  job.src_stride[0] = job.dst_stride[0] = stride;
+  job.bpp = 4;
+  job.num_planes = 1;
+  job.y_ss[0] = 1;
+  job.width = width;
+  job.height = height;
+
+  sl_copy_queue* queue = sl_copy_queue_create(nullptr, 0);
+  job.dst_addr = dst_a.data();
+  uint64_t first = sl_copy_queue_submit(queue, &job, {{0, 0, width, height}});
+  job.dst_addr = dst_b.data();
+  uint64_t second =
+      sl_copy_queue_submit(queue, &job, {{0, 0, width, height / 2}});
+  EXPECT_LT(first, second);
+
+  sl_copy_queue_wait(queue, second);
+  uint64_t ticket;
+  size_t bytes_copied;
+  ASSERT_TRUE(sl_copy_queue_poll(queue, &ticket, &bytes_copied));
+  EXPECT_EQ(ticket, first);
+  EXPECT_EQ(bytes_copied, stride * height);
+  ASSERT_TRUE(sl_copy_queue_poll(queue, &ticket, &bytes_copied));
+  EXPECT_EQ(ticket, second);
+  EXPECT_EQ(bytes_copied, stride * height / 2);
+  EXPECT_FALSE(sl_copy_queue_poll(queue, &ticket, &bytes_copied));
+  sl_copy_queue_destroy(queue);
+
+  EXPECT_EQ(dst_a, src);
+  EXPECT_EQ(memcmp(dst_b.data(), src.data(), stride * height / 2), 0);
+  EXPECT_EQ(dst_b[stride * height / 2], 0);
+}
+
+TEST(CopyTest, AllHashKernelsMatchScalar) {
+  size_t num_kernels;
+  const sl_hash_kernel* const* kernels =
+      sl_copy_supported_hash_kernels(&num_kernels);
+  ASSERT_GE(num_kernels, 1u);
+
+  // Cover rows shorter than a vector, the vector loops and partial tails.
+  const size_t row_bytes[] = {1, 15, 16, 31, 33, 256, 257};
+  const size_t rows = 4;
+  const size_t stride = 300;
+  std::vector<uint8_t> src(stride * rows + 1);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<uint8_t>(i * 7 + 1);
+
+  for (size_t bytes : row_bytes) {
+    uint64_t expected = kernels[0]->hash_rows(src.data(), stride, bytes, rows);
+    EXPECT_NE(expected, 0u);
+    for (size_t k = 1; k < num_kernels; ++k) {
+      EXPECT_EQ(kernels[k]->hash_rows(src.data() + 1, stride, bytes, rows),
+                kernels[0]->hash_rows(src.data() + 1, stride, bytes, rows))
+          << kernels[k]->name << " bytes=" << bytes;
+    }
+
+    // Any change to a byte, or swapping two rows, changes the hash.
+    std::vector<uint8_t> changed(src);
+    changed[(rows - 1) * stride + bytes - 1] ^= 1;
+    EXPECT_NE(kernels[0]->hash_rows(changed.data(), stride, bytes, rows),
+              expected);
+    changed = src;
+    memcpy(changed.data(), src.data() + stride, bytes);
+    memcpy(changed.data() + stride, src.data(), bytes);
+    if (memcmp(src.data(), src.data() + stride, bytes)) {
+      EXPECT_NE(kernels[0]->hash_rows(changed.data(), stride, bytes, rows),
+                expected);
+    }
+  }
+}
+
+TEST(CopyTest, TileHashingDropsUnchangedTiles) {
+  const int32_t width = 200, height = 100;
+  const size_t stride = width * 4;
+  std::vector<uint8_t> src(stride * height, 0x11);
+
+  sl_copy_job job = {};
+  job.src_addr = src.data();
+  job.src_stride[0] = stride;
+  job.bpp = 4;
+  job.num_planes = 1;
+  job.y_ss[0] = 1;
+  job.width = width;
+  job.height = height;
+  const sl_hash_kernel* kernel = sl_copy_hash_kernel();
+  sl_copy_tile_hashes copy_tiles, host_tiles;
+  pixman_region32_t copy_damage, host_damage;
+  pixman_box32_t* rects;
+  int n;
+
+  // Nothing is known about the destination yet, so everything is kept and
+  // the copy damage is rounded out to whole tiles.
+  pixman_region32_init_rect(&copy_damage, 0, 0, width, height);
+  pixman_region32_init_rect(&host_damage, 10, 10, 4, 4);
+  sl_copy_reduce_damage(&job, kernel, &copy_damage, &copy_tiles, &host_damage,
+                        &host_tiles);
+  rects = pixman_region32_rectangles(&copy_damage, &n);
+  ASSERT_EQ(n, 1);
+  EXPECT_EQ(rects[0].x2, width);
+  EXPECT_EQ(rects[0].y2, height);
+  rects = pixman_region32_rectangles(&host_damage, &n);
+  ASSERT_EQ(n, 1);
+  EXPECT_EQ(rects[0].x1, 10);
+  EXPECT_EQ(rects[0].x2, 14);
+
+  // Redrawing identical content produces no damage at all.
+  pixman_region32_union_rect(&copy_damage, &copy_damage, 0, 0, width, height);
+  pixman_region32_union_rect(&host_damage, &host_damage, 0, 0, width, height);
+  sl_copy_reduce_damage(&job, kernel, &copy_damage, &copy_tiles, &host_damage,
+                        &host_tiles);
+  pixman_region32_rectangles(&copy_damage, &n);
+  EXPECT_EQ(n, 0);
+  pixman_region32_rectangles(&host_damage, &n);
+  EXPECT_EQ(n, 0);
+
+  // A single changed pixel keeps only its tile, clipped to the buffer.
+  src[70 * stride + 130 * 4] = 0x22;
+  pixman_region32_union_rect(&copy_damage, &copy_damage, 0, 0, width, height);
+  pixman_region32_union_rect(&host_damage, &host_damage, 100, 50, 100, 50);
+  sl_copy_reduce_damage(&job, kernel, &copy_damage, &copy_tiles, &host_damage,
+                        &host_tiles);
+  rects = pixman_region32_rectangles(&copy_damage, &n);
+  ASSERT_EQ(n, 1);
+  EXPECT_EQ(rects[0].x1, 128);
+  EXPECT_EQ(rects[0].y1, 64);
+  EXPECT_EQ(rects[0].x2, 192);
+  EXPECT_EQ(rects[0].y2, height);
+  rects = pixman_region32_rectangles(&host_damage, &n);
+  ASSERT_EQ(n, 1);
+  EXPECT_EQ(rects[0].x1, 128);
+  EXPECT_EQ(rects[0].y1, 64);
+  EXPECT_EQ(rects[0].x2, 192);
+  EXPECT_EQ(rects[0].y2, height);
+
+  // A size change forgets every hash.
+  job.width = width / 2;
+  pixman_region32_union_rect(&copy_damage, &copy_damage, 0, 0, width, height);
+  sl_copy_reduce_damage(&job, kernel, &copy_damage, &copy_tiles, &host_damage,
+                        &host_tiles);
+  rects = pixman_region32_rectangles(&copy_damage, &n);
+  ASSERT_EQ(n, 1);
+  EXPECT_EQ(rects[0].x2, width / 2);
+
+  pixman_region32_fini(&host_damage);
+  pixman_region32_fini(&copy_damage);
+}
+
+TEST(StatsTest, DumpsCountersAndGauges) {
+  uint64_t hits = sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS);
+  char* output = NULL;
+  size_t output_size = 0;
+  FILE* stream = open_memstream(&output, &output_size);
+
+  sl_stats_add(SL_STAT_OUTPUT_BUFFER_POOL_HITS, 3);
+  sl_stats_set(SL_STAT_OUTPUT_BUFFER_POOL_BYTES, 4096);
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_HITS), hits + 3);
+  EXPECT_EQ(sl_stats_get(SL_STAT_OUTPUT_BUFFER_POOL_BYTES), 4096u);
+
+  sl_stats_dump(stream);
+  fclose(stream);
+
+  std::string dump(output, output_size);
+  free(output);
+  EXPECT_NE(dump.find("output_buffer_pool_hits: " + std::to_string(hits + 3)),
+            std::string::npos);
+  EXPECT_NE(dump.find("output_buffer_pool_bytes: 4096\n"), std::string::npos);
+}
+
 }  // namespace sommelier
 }  // namespace vm_tools
 
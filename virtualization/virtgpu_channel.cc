@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/udmabuf.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,6 +36,8 @@
 // DRM Render nodes start at 128
 #define DRM_RENDER_NODE_START 128
 
+#define UDMABUF_DEVICE "/dev/udmabuf"
+
 #define MAX_SEND_SIZE \
   (DEFAULT_BUFFER_SIZE - sizeof(struct CrossDomainSendReceive))
 #define MAX_WRITE_SIZE \
@@ -121,6 +124,9 @@ VirtGpuChannel::~VirtGpuChannel() {
   if (ring_handle_)
     close_gem_handle(ring_handle_);
 
+  if (udmabuf_ >= 0)
+    close(udmabuf_);
+
   if (virtgpu_ >= 0)
     close(virtgpu_);
 }
@@ -192,6 +198,11 @@ int32_t VirtGpuChannel::init() {
     return -ENOTSUP;
   }
 
+  // Shared memory import is optional.  It needs a host that accepts dma-bufs
+  // and a guest kernel with udmabuf.
+  if (supports_dmabuf_)
+    udmabuf_ = open(UDMABUF_DEVICE, O_RDWR | O_CLOEXEC);
+
   return 0;
 }
 
@@ -199,6 +210,10 @@ bool VirtGpuChannel::supports_dmabuf(void) {
   return supports_dmabuf_;
 }
 
+bool VirtGpuChannel::supports_shm_import(void) {
+  return udmabuf_ >= 0;
+}
+
 int32_t VirtGpuChannel::create_context(int& out_channel_fd) {
   int ret;
   struct drm_virtgpu_map map = {0};
@@ -290,12 +305,9 @@ int32_t VirtGpuChannel::create_pipe(int& out_pipe_fd) {
 
 int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
   int32_t ret;
-  uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
-
   struct CrossDomainSendReceive* cmd_send =
-      (struct CrossDomainSendReceive*)cmd_buffer;
-
-  void* send_data = &cmd_buffer[sizeof(struct CrossDomainSendReceive)];
+      (struct CrossDomainSendReceive*)send_cmd_.data();
+  uint8_t* send_data = send_buffer();
 
   memset(cmd_send, 0, sizeof(struct CrossDomainSendReceive));
 
@@ -309,7 +321,9 @@ int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
   cmd_send->hdr.cmd_size =
       sizeof(struct CrossDomainSendReceive) + send.data_size;
 
-  memcpy(send_data, send.data, send.data_size);
+  // Callers that built the data in send_buffer() save a copy.
+  if (send.data != send_data)
+    memcpy(send_data, send.data, send.data_size);
   cmd_send->opaque_data_size = send.data_size;
 
   for (uint32_t i = 0; i < CROSS_DOMAIN_MAX_IDENTIFIERS; i++) {
@@ -341,6 +355,9 @@ int32_t VirtGpuChannel::handle_channel_event(
   ssize_t bytes_read;
   struct drm_event dummy_event;
 
+  if (receive_pending_)
+    return -EBUSY;
+
   bytes_read = read(virtgpu_, &dummy_event, sizeof(struct drm_event));
   if (bytes_read < (int)sizeof(struct drm_event)) {
     fprintf(stderr, "invalid event size\n");
@@ -357,6 +374,11 @@ int32_t VirtGpuChannel::handle_channel_event(
     ret = handle_receive(event_type, receive, out_read_pipe);
     if (ret)
       return ret;
+
+    // The data is read straight out of the ring, so polling resumes in
+    // release_receive().
+    receive_pending_ = true;
+    return 0;
   } else if (cmd_hdr->cmd == CROSS_DOMAIN_CMD_READ) {
     event_type = WaylandChannelEvent::Read;
     ret = handle_read();
@@ -374,6 +396,14 @@ int32_t VirtGpuChannel::handle_channel_event(
   return 0;
 }
 
+int32_t VirtGpuChannel::release_receive(void) {
+  if (!receive_pending_)
+    return 0;
+
+  receive_pending_ = false;
+  return channel_poll();
+}
+
 int32_t VirtGpuChannel::allocate(
     const struct WaylandBufferCreateInfo& create_info,
     struct WaylandBufferCreateOutput& create_output) {
@@ -394,6 +424,76 @@ int32_t VirtGpuChannel::sync(int dmabuf_fd, uint64_t flags) {
   return 0;
 }
 
+int32_t VirtGpuChannel::import_shm(
+    const struct WaylandShmImportInfo& import_info,
+    struct WaylandBufferCreateOutput& import_output) {
+  int32_t ret;
+  int seals;
+  uint32_t gem_handle;
+  uint64_t page_size = PAGE_SIZE;
+  uint64_t start, end;
+  struct stat statbuf;
+  struct udmabuf_create create = {0};
+  struct drm_virtgpu_resource_info drm_res_info = {0};
+
+  if (udmabuf_ < 0)
+    return -EOPNOTSUPP;
+
+  // udmabuf only accepts memfds that are sealed against shrinking, and not
+  // against writing.  The seal is not added here: the memfd belongs to the
+  // client, which may still shrink it through another pool or descriptor.
+  seals = fcntl(import_info.fd, F_GET_SEALS);
+  if (seals < 0)
+    return -errno;
+  if ((seals & F_SEAL_WRITE) || !(seals & F_SEAL_SHRINK))
+    return -EINVAL;
+
+  ret = fstat(import_info.fd, &statbuf);
+  if (ret)
+    return -errno;
+
+  start = import_info.offset & ~(page_size - 1);
+  end = (import_info.offset + import_info.size + page_size - 1) &
+        ~(page_size - 1);
+  if (end > static_cast<uint64_t>(statbuf.st_size))
+    return -EINVAL;
+
+  create.memfd = import_info.fd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = start;
+  create.size = end - start;
+  ret = ioctl(udmabuf_, UDMABUF_CREATE, &create);
+  if (ret < 0)
+    return -errno;
+
+  // Importing the dma-buf into virtgpu creates a guest memory blob backed by
+  // the pool's pages, which is what `send` hands to the host.  Make sure that
+  // works now so the caller can still fall back to copying.
+  import_output.fd = ret;
+  ret = drmPrimeFDToHandle(virtgpu_, import_output.fd, &gem_handle);
+  if (ret) {
+    ret = -errno;
+    close(import_output.fd);
+    import_output.fd = -1;
+    return ret;
+  }
+
+  drm_res_info.bo_handle = gem_handle;
+  ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &drm_res_info);
+  if (ret)
+    ret = -errno;
+  close_gem_handle(gem_handle);
+  if (ret) {
+    close(import_output.fd);
+    import_output.fd = -1;
+    return ret;
+  }
+
+  import_output.offsets[0] = import_info.offset - start;
+  import_output.host_size = end - start;
+  return 0;
+}
+
 int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
   uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
   ssize_t bytes_read;
@@ -756,15 +856,7 @@ int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
     }
   }
 
-  if (cmd_receive->opaque_data_size > 0) {
-    receive.data =
-        reinterpret_cast<uint8_t*>(calloc(1, cmd_receive->opaque_data_size));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, cmd_receive->opaque_data_size);
-  }
-
+  receive.data = recv_data;
   receive.data_size = cmd_receive->opaque_data_size;
   return 0;
 }
@@ -837,3 +929,15 @@ int32_t VirtGpuChannel::pipe_lookup(uint32_t identifier_type,
 size_t VirtGpuChannel::max_send_size(void) {
   return MAX_SEND_SIZE;
 }
+
+uint8_t* VirtGpuChannel::send_buffer(void) {
+  return send_cmd_.data() + sizeof(struct CrossDomainSendReceive);
+}
+
+size_t VirtGpuChannel::release_caches(void) {
+  size_t count = description_cache_.size();
+
+  // Swap with an empty vector, as clear() keeps the allocation.
+  std::vector<BufferDescription>().swap(description_cache_);
+  return count;
+}
@@ -95,15 +95,14 @@ int32_t VirtWaylandChannel::create_pipe(int& out_pipe_fd) {
 
 int32_t VirtWaylandChannel::send(const struct WaylandSendReceive& send) {
   int ret;
-  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
-
-  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* send_data = &txn->data;
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)send_txn_.data();
+  uint8_t* send_data = send_buffer();
 
   if (send.data_size > max_send_size())
     return -EINVAL;
 
-  memcpy(send_data, send.data, send.data_size);
+  if (send.data != send_data)
+    memcpy(send_data, send.data, send.data_size);
 
   for (uint32_t i = 0; i < WAYLAND_MAX_FDs; i++) {
     if (i < send.num_fds) {
@@ -126,11 +125,9 @@ int32_t VirtWaylandChannel::handle_channel_event(
     struct WaylandSendReceive& receive,
     int& out_read_pipe) {
   int ret;
-  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
-
-  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  void* recv_data = &txn->data;
+  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)recv_txn_.data();
+  size_t max_recv_size = recv_txn_.size() - sizeof(struct virtwl_ioctl_txn);
+  uint8_t* recv_data = recv_txn_.data() + sizeof(struct virtwl_ioctl_txn);
 
   txn->len = max_recv_size;
   ret = ioctl(receive.channel_fd, VIRTWL_IOCTL_RECV, txn);
@@ -146,19 +143,17 @@ int32_t VirtWaylandChannel::handle_channel_event(
     }
   }
 
-  if (txn->len > 0) {
-    receive.data = reinterpret_cast<uint8_t*>(calloc(1, txn->len));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, txn->len);
-  }
-
+  receive.data = recv_data;
   receive.data_size = txn->len;
   event_type = WaylandChannelEvent::Receive;
   return 0;
 }
 
+int32_t VirtWaylandChannel::release_receive(void) {
+  // The next VIRTWL_IOCTL_RECV simply overwrites the transaction.
+  return 0;
+}
+
 int32_t VirtWaylandChannel::allocate(
     const struct WaylandBufferCreateInfo& create_info,
     struct WaylandBufferCreateOutput& create_output) {
@@ -214,6 +209,18 @@ int32_t VirtWaylandChannel::sync(int dmabuf_fd, uint64_t flags) {
   return 0;
 }
 
+bool VirtWaylandChannel::supports_shm_import(void) {
+  // virtwl can only send resources it allocated itself (or virtgpu
+  // resources), so there is no way to hand it pages owned by a client.
+  return false;
+}
+
+int32_t VirtWaylandChannel::import_shm(
+    const struct WaylandShmImportInfo& import_info,
+    struct WaylandBufferCreateOutput& import_output) {
+  return -EOPNOTSUPP;
+}
+
 int32_t VirtWaylandChannel::handle_pipe(int read_fd,
                                         bool readable,
                                         bool& hang_up) {
@@ -223,3 +230,11 @@ int32_t VirtWaylandChannel::handle_pipe(int read_fd,
 size_t VirtWaylandChannel::max_send_size(void) {
   return MAX_SEND_SIZE;
 }
+
+uint8_t* VirtWaylandChannel::send_buffer(void) {
+  return send_txn_.data() + sizeof(struct virtwl_ioctl_txn);
+}
+
+size_t VirtWaylandChannel::release_caches(void) {
+  return 0;
+}
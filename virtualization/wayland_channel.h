@@ -73,6 +73,17 @@ struct WaylandBufferCreateOutput {
   uint64_t host_size;
 };
 
+/*
+ * Describes a range of a client's shared memory pool to be shared with the
+ * host without copying.  `fd` must be a memfd.  The range does not need to be
+ * page aligned.
+ */
+struct WaylandShmImportInfo {
+  int fd;
+  uint64_t offset;
+  uint64_t size;
+};
+
 class WaylandChannel {
  public:
   WaylandChannel() {}
@@ -127,9 +138,10 @@ class WaylandChannel {
   // in addition to forwarding the data given by `receive`.  The `handle_pipe`
   // function must be called the case of `out_read_pipe` event.
   //
-  // In both above cases, if the returned `receive.data_size` is than greater
-  // zero, then the caller takes ownership of `receive.data` and must free(..)
-  // the memory when appropriate.
+  // In both above cases, `receive.data` points into memory owned by the
+  // channel, which stays valid until `release_receive` is called.  The caller
+  // must call `release_receive` once it is done with the data and before
+  // handling the next event.  The caller takes ownership of `receive.fds`.
   //
   // If `event_type` is WaylandChannelEvent::Read, then both `out_read_pipe` and
   // `receive` are meaningless. The implementation handles the event internally.
@@ -137,6 +149,13 @@ class WaylandChannel {
                                        struct WaylandSendReceive& receive,
                                        int& out_read_pipe) = 0;
 
+  // Returns the memory lent out by the last WaylandChannelEvent::Receive or
+  // ReceiveAndProxy event to the channel, which may then receive the next
+  // message into it.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t release_receive(void) = 0;
+
   // Allocates a shared memory resource or dma-buf on the host.  Maps it into
   // the guest.  The intended use case for this function is sharing resources
   // with the host compositor when virtgpu 3d is not enabled.
@@ -149,6 +168,22 @@ class WaylandChannel {
   // Returns 0 on success.  Returns -errno on failure.
   virtual int32_t sync(int dmabuf_fd, uint64_t flags) = 0;
 
+  // Returns true if the channel can share guest shared memory with the host
+  // via `import_shm`.
+  virtual bool supports_shm_import(void) = 0;
+
+  // Creates a dma-buf backed by the pages of the shared memory range given by
+  // `import_info`, which the host can use directly.  `import_output.fd` is the
+  // new dma-buf and `import_output.offsets[0]` is the position of
+  // `import_info.offset` within it.  Only memfds the client has sealed against
+  // shrinking can be imported.  Callers fall back to allocating a buffer and
+  // copying into it on failure.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t import_shm(
+      const struct WaylandShmImportInfo& import_info,
+      struct WaylandBufferCreateOutput& import_output) = 0;
+
   // Reads from the specified `read_fd` and forwards to the host if `readable`
   // is true.  Closes the `read_fd` and the proxied write fd on the host if
   // `hang_up` is true and all the data has been read.
@@ -159,12 +194,27 @@ class WaylandChannel {
 
   // Returns the maximum size of opaque data that the channel is able to handle
   // in the `send` function.  Must be less than or equal to DEFAULT_BUFFER_SIZE.
+  // Messages from the client are batched up to this size.
   virtual size_t max_send_size(void) = 0;
+
+  // Returns memory owned by the channel with room for `max_send_size` bytes,
+  // or NULL if the channel has none.  If `send.data` points at it, `send`
+  // submits the data in place rather than copying it into a command first.
+  // `send` never modifies the data in this buffer.
+  virtual uint8_t* send_buffer(void) = 0;
+
+  // Drops anything the channel caches to speed up later requests, to give
+  // memory back under pressure.  Returns the number of entries dropped.
+  virtual size_t release_caches(void) = 0;
 };
 
 class VirtWaylandChannel : public WaylandChannel {
  public:
-  VirtWaylandChannel() : virtwl_{-1}, supports_dmabuf_(false) {}
+  VirtWaylandChannel()
+      : virtwl_{-1},
+        supports_dmabuf_(false),
+        send_txn_(DEFAULT_BUFFER_SIZE),
+        recv_txn_(DEFAULT_BUFFER_SIZE) {}
   ~VirtWaylandChannel();
 
   int32_t init() override;
@@ -175,18 +225,28 @@ class VirtWaylandChannel : public WaylandChannel {
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override;
+  int32_t release_receive(void) override;
 
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override;
 
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
+  bool supports_shm_import(void) override;
+  int32_t import_shm(const struct WaylandShmImportInfo& import_info,
+                     struct WaylandBufferCreateOutput& import_output) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size(void) override;
+  uint8_t* send_buffer(void) override;
+  size_t release_caches(void) override;
 
  private:
   // virtwl device file descriptor
   int32_t virtwl_;
   bool supports_dmabuf_;
+  // VIRTWL_IOCTL_SEND transaction reused for every `send`.
+  std::vector<uint8_t> send_txn_;
+  // VIRTWL_IOCTL_RECV transaction that received data is lent out of.
+  std::vector<uint8_t> recv_txn_;
 };
 
 class VirtGpuChannel : public WaylandChannel {
@@ -195,8 +255,11 @@ class VirtGpuChannel : public WaylandChannel {
       : virtgpu_{-1},
         ring_addr_{MAP_FAILED},
         ring_handle_{0},
+        udmabuf_{-1},
         supports_dmabuf_(false),
-        descriptor_id_{1} {}
+        receive_pending_(false),
+        descriptor_id_{1},
+        send_cmd_(DEFAULT_BUFFER_SIZE) {}
   ~VirtGpuChannel();
 
   int32_t init() override;
@@ -207,13 +270,19 @@ class VirtGpuChannel : public WaylandChannel {
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override;
+  int32_t release_receive(void) override;
 
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override;
 
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
+  bool supports_shm_import(void) override;
+  int32_t import_shm(const struct WaylandShmImportInfo& import_info,
+                     struct WaylandBufferCreateOutput& import_output) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size(void) override;
+  uint8_t* send_buffer(void) override;
+  size_t release_caches(void) override;
 
  private:
   /*
@@ -275,10 +344,19 @@ class VirtGpuChannel : public WaylandChannel {
   int32_t virtgpu_;
   void* ring_addr_;
   uint32_t ring_handle_;
+  // udmabuf device file descriptor, or -1 if shm import is not supported.
+  int32_t udmabuf_;
   bool supports_dmabuf_;
+  // True while the data of a received message is lent out of the ring.  The
+  // host is not asked to poll again until it is released, as it would
+  // overwrite the data.
+  bool receive_pending_;
   // Matches the crosvm-side descriptor_id, must be an odd number.
   uint32_t descriptor_id_;
 
+  // CROSS_DOMAIN_CMD_SEND command reused for every `send`.
+  std::vector<uint8_t> send_cmd_;
+
   std::vector<BufferDescription> description_cache_;
   std::vector<PipeDescription> pipe_cache_;
 };